@@ -1,5 +1,15 @@
+#define _XOPEN_SOURCE 700
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BUGSP_X86 1
+#endif
 
 #include <editline/readline.h>
 #include <histedit.h>
@@ -9,37 +19,81 @@
 
 /* constructors & destructors */
 
+lval* lval_alloc(void) {
+    if (free_lvals.count == 0) {
+        return calloc(1, sizeof(lval));
+    }
+    lval* v = free_lvals.items[--free_lvals.count];
+    memset(v, 0, sizeof(lval));
+    return v;
+}
+
+void lval_free(lval* v) {
+    if (free_lvals.count == LVAL_POOL_SIZE) {
+        free(v);
+        return;
+    }
+    free_lvals.items[free_lvals.count++] = v;
+}
+
 lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_ERR;
 
     va_list va;
     va_start(va, fmt);
 
-    v->err = malloc(ERROR_BUFFER_LEN);
-    vsnprintf(v->err, ERROR_BUFFER_LEN - 1, fmt, va);
-    v->err = realloc(v->err, strlen(v->err) + 1);
+    char buf[ERROR_BUFFER_LEN];
+    vsnprintf(buf, ERROR_BUFFER_LEN, fmt, va);
+    v->err = malloc(strlen(buf) + 1);
+    strcpy(v->err, buf);
 
     va_end(va);
     return v;
 }
 
+/* a coded error only records its arguments, func must outlive the error
+ * except for LERR_UNBOUND & LERR_USER where it's copied */
+lval* lval_err_code(int code, char* func, long x, long y, long z) {
+    lval* v = lval_alloc();
+    v->type = LVAL_ERR;
+    v->err_code = code;
+    v->err_arg[0] = x;
+    v->err_arg[1] = y;
+    v->err_arg[2] = z;
+
+    switch (code) {
+        case LERR_UNBOUND:
+            v->sym = malloc(strlen(func) + 1);
+            strcpy(v->sym, func);
+            break;
+        case LERR_USER:
+            v->err = malloc(strlen(func) + 1);
+            strcpy(v->err, func);
+            break;
+        default:
+            v->err_func = func;
+            break;
+    }
+    return v;
+}
+
 lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_NUM;
     v->num = x;
     return v;
 }
 
 lval* lval_bool(int x) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_BOOL;
     v->num = x;
     return v;
 }
 
 lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SYM;
     v->sym = malloc(strlen(s) + 1);
     strcpy(v->sym, s);
@@ -47,7 +101,7 @@ lval* lval_sym(char* s) {
 }
 
 lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_STR;
     v->str = malloc(strlen(s) + 1);
     strcpy(v->str, s);
@@ -55,24 +109,25 @@ lval* lval_str(char* s) {
 }
 
 lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_FUN;
     v->builtin = func;
     return v;
 }
 
 lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_FUN;
     v->builtin = NULL;
-    v->env = lenv_new();
-    v->formals = formals;
-    v->body = body;
+    v->fun = calloc(1, sizeof(lfun));
+    v->fun->refs = 1;
+    v->fun->formals = formals;
+    v->fun->body = body;
     return v;
 }
 
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_SEXPR;
     v->count = 0;
     v->cell = NULL;
@@ -80,17 +135,59 @@ lval* lval_sexpr(void) {
 }
 
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc();
     v->type = LVAL_QEXPR;
     v->count = 0;
     v->cell = NULL;
     return v;
 }
 
+lval* lval_seq(lseq* s) {
+    lval* v = lval_alloc();
+    v->type = LVAL_SEQ;
+    v->seq = s;
+    return v;
+}
+
+lval* lval_map(lmap* m) {
+    lval* v = lval_alloc();
+    v->type = LVAL_MAP;
+    v->map = m;
+    return v;
+}
+
+lval* lval_memo(lmemo* m) {
+    lval* v = lval_alloc();
+    v->type = LVAL_FUN;
+    v->memo = m;
+    return v;
+}
+
+lval* lval_arr(larr* a) {
+    lval* v = lval_alloc();
+    v->type = LVAL_ARR;
+    v->arr = a;
+    return v;
+}
+
+lval* lval_vec(lvec* vec, long off, long len) {
+    lval* v = lval_alloc();
+    v->type = LVAL_VEC;
+    v->vec = vec;
+    v->vec_off = off;
+    v->vec_len = len;
+    return v;
+}
+
 void lval_del(lval* v) {
+    if (v->interned) {
+        return;
+    }
+
     switch(v->type) {
         case LVAL_ERR:
             free(v->err);
+            free(v->sym);
             break;
         case LVAL_NUM:
         case LVAL_BOOL:
@@ -102,26 +199,45 @@ void lval_del(lval* v) {
             free(v->str);
             break;
         case LVAL_FUN:
-            if (v->builtin == NULL) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
+            if (v->memo) {
+                lmemo_del(v->memo);
+            } else if (v->builtin == NULL) {
+                lfun_del(v->fun);
+                for (int i = 0; i < v->count; i++) {
+                    lval_del(v->cell[i]);
+                }
+                free(v->cell);
             }
             break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
+        case LVAL_RECUR:
             for (int i = 0; i < v->count; i++) {
                 lval_del(v->cell[i]);
             }
             free(v->cell);
+            if (v->native) { lnum_del(v->native); }
+            if (v->cases) { lcase_del(v->cases); }
+            break;
+        case LVAL_SEQ:
+            lseq_del(v->seq);
+            break;
+        case LVAL_MAP:
+            lmap_del(v->map);
+            break;
+        case LVAL_ARR:
+            larr_del(v->arr);
+            break;
+        case LVAL_VEC:
+            lvec_del(v->vec);
             break;
     }
 
-    free(v);
+    lval_free(v);
 }
 
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = calloc(1, sizeof(lenv));
     e->parent = NULL;
     e->count = 0;
     e->syms = NULL;
@@ -131,37 +247,527 @@ lenv* lenv_new(void) {
 
 void lenv_del(lenv* e) {
     for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+        lenv_drop(e, i);
     }
     free(e->syms);
     free(e->vals);
+    if (e->exports) {
+        lval_del(e->exports);
+    }
     free(e);
 }
 
-/* lenv helpers */
+lseq* lseq_new(int kind, lseq* src, lval* fn) {
+    lseq* s = calloc(1, sizeof(lseq));
+    s->kind = kind;
+    s->src = src;
+    s->fn = fn;
+    return s;
+}
 
-lval* lenv_get(lenv* e, lval* k) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+void lseq_del(lseq* s) {
+    if (s == NULL) {
+        return;
+    }
+    if (s->list) {
+        lval_del(s->list);
+    }
+    if (s->fn) {
+        lval_del(s->fn);
+    }
+    lseq_del(s->src);
+    free(s);
+}
+
+lseq* lseq_copy(lseq* s) {
+    if (s == NULL) {
+        return NULL;
+    }
+
+    lseq* n = malloc(sizeof(lseq));
+    *n = *s;
+    n->list = s->list ? lval_copy(s->list) : NULL;
+    n->fn = s->fn ? lval_copy(s->fn) : NULL;
+    n->src = lseq_copy(s->src);
+    return n;
+}
+
+/* takes over the caller's reference to root, NULL for an empty map */
+lmap* lmap_new(lmap_node* root, long count) {
+    lmap* m = malloc(sizeof(lmap));
+    m->refs = 1;
+    m->count = count;
+    m->root = root;
+    return m;
+}
+
+/* a new map sharing m's nodes, taking the caller's reference to m */
+lmap* lmap_fork(lmap* m) {
+    lmap* n = lmap_new(m->root, m->count);
+    if (m->root) {
+        m->root->refs++;
+    }
+    lmap_del(m);
+    return n;
+}
+
+void lmap_del(lmap* m) {
+    if (--m->refs > 0) {
+        return;
+    }
+    if (m->root) {
+        lmap_node_del(m->root);
+    }
+    free(m);
+}
+
+lmap_node* lmap_leaf(unsigned long h, lval* k, lval* v) {
+    lmap_node* n = calloc(1, sizeof(lmap_node));
+    n->refs = 1;
+    n->hash = h;
+    n->key = k;
+    n->val = v;
+    return n;
+}
+
+void lmap_node_del(lmap_node* n) {
+    if (--n->refs > 0) {
+        return;
+    }
+    if (n->key) {
+        lval_del(n->key);
+        lval_del(n->val);
+    }
+    for (int i = 0; i < n->count; i++) {
+        lmap_node_del(n->kids[i]);
+    }
+    free(n->kids);
+    free(n);
+}
+
+/* kids arrays grow in powers of two */
+int lmap_kids_cap(int count) {
+    int cap = 1;
+    while (cap < count) {
+        cap *= 2;
+    }
+    return cap;
+}
+
+/* n itself if only the caller holds it, otherwise a copy of it sharing
+ * its kids. Either way the caller's reference moves to the result */
+lmap_node* lmap_node_own(lmap_node* n) {
+    if (n->refs == 1) {
+        return n;
+    }
+
+    lmap_node* x = malloc(sizeof(lmap_node));
+    *x = *n;
+    x->refs = 1;
+    x->kids = malloc(sizeof(lmap_node*) * lmap_kids_cap(n->count));
+    for (int i = 0; i < n->count; i++) {
+        x->kids[i] = n->kids[i];
+        x->kids[i]->refs++;
+    }
+    n->refs--;
+    return x;
+}
+
+/* inserts kid into the branch or collision node n at i */
+lmap_node* lmap_node_insert(lmap_node* n, int i, lmap_node* kid) {
+    if (n->count == 0 || n->count == lmap_kids_cap(n->count)) {
+        n->kids = realloc(n->kids, sizeof(lmap_node*) * lmap_kids_cap(n->count + 1));
+    }
+    memmove(&n->kids[i + 1], &n->kids[i], sizeof(lmap_node*) * (n->count - i));
+    n->kids[i] = kid;
+    n->count++;
+    return n;
+}
+
+/* a node holding a & b, two leaves or collision nodes of different keys
+ * meeting at the level given by shift */
+lmap_node* lmap_pair(lmap_node* a, lmap_node* b, int shift) {
+    lmap_node* n = calloc(1, sizeof(lmap_node));
+    n->refs = 1;
+
+    if (a->hash == b->hash) {
+        n->hash = a->hash;
+        lmap_node_insert(n, 0, a);
+        return lmap_node_insert(n, 1, b);
+    }
+
+    unsigned int ia = (a->hash >> shift) & ((1 << MAP_BITS) - 1);
+    unsigned int ib = (b->hash >> shift) & ((1 << MAP_BITS) - 1);
+    if (ia == ib) {
+        n->bitmap = 1u << ia;
+        return lmap_node_insert(n, 0, lmap_pair(a, b, shift + MAP_BITS));
+    }
+    n->bitmap = (1u << ia) | (1u << ib);
+    lmap_node_insert(n, 0, ia < ib ? a : b);
+    return lmap_node_insert(n, 1, ia < ib ? b : a);
+}
+
+/* the leaf holding k, or NULL */
+lmap_node* lmap_find(lmap* m, lval* k, unsigned long h) {
+    lmap_node* n = m->root;
+    int shift = 0;
+    while (n) {
+        if (n->key) {
+            return n->hash == h && lval_eq(n->key, k) ? n : NULL;
+        }
+        if (n->bitmap == 0) {
+            for (int i = 0; n->hash == h && i < n->count; i++) {
+                if (lval_eq(n->kids[i]->key, k)) {
+                    return n->kids[i];
+                }
+            }
+            return NULL;
+        }
+
+        unsigned int bit = 1u << ((h >> shift) & ((1 << MAP_BITS) - 1));
+        if (!(n->bitmap & bit)) {
+            return NULL;
+        }
+        n = n->kids[__builtin_popcount(n->bitmap & (bit - 1))];
+        shift += MAP_BITS;
+    }
+    return NULL;
+}
+
+/* puts k & v under n, returning what replaces n. Takes ownership of k,
+ * v & the caller's reference to n; shared nodes on the way down are
+ * copied, the rest changed in place. added is set for a new key */
+lmap_node* lmap_assoc(lmap_node* n, int shift, unsigned long h,
+                      lval* k, lval* v, int* added) {
+    if (n == NULL) {
+        *added = 1;
+        return lmap_leaf(h, k, v);
+    }
+
+    if (n->key) {
+        if (n->hash != h || !lval_eq(n->key, k)) {
+            *added = 1;
+            return lmap_pair(n, lmap_leaf(h, k, v), shift);
+        }
+        if (n->refs > 1) {
+            n->refs--;
+            return lmap_leaf(h, k, v);
+        }
+        lval_del(k);
+        lval_del(n->val);
+        n->val = v;
+        return n;
+    }
+
+    if (n->bitmap == 0) {
+        if (n->hash != h) {
+            *added = 1;
+            return lmap_pair(n, lmap_leaf(h, k, v), shift);
+        }
+        n = lmap_node_own(n);
+        for (int i = 0; i < n->count; i++) {
+            if (lval_eq(n->kids[i]->key, k)) {
+                n->kids[i] = lmap_assoc(n->kids[i], shift, h, k, v, added);
+                return n;
+            }
         }
+        *added = 1;
+        return lmap_node_insert(n, n->count, lmap_leaf(h, k, v));
+    }
+
+    unsigned int bit = 1u << ((h >> shift) & ((1 << MAP_BITS) - 1));
+    int i = __builtin_popcount(n->bitmap & (bit - 1));
+    n = lmap_node_own(n);
+    if (n->bitmap & bit) {
+        n->kids[i] = lmap_assoc(n->kids[i], shift + MAP_BITS, h, k, v, added);
+        return n;
+    }
+    *added = 1;
+    n->bitmap |= bit;
+    return lmap_node_insert(n, i, lmap_leaf(h, k, v));
+}
+
+/* removes k, which must be under n, returning what replaces n: NULL if
+ * nothing is left, and a lone leaf or collision node is pulled up */
+lmap_node* lmap_dissoc(lmap_node* n, int shift, unsigned long h, lval* k) {
+    if (n->key) {
+        lmap_node_del(n);
+        return NULL;
     }
 
-    if (e->parent) {
-        return lenv_get(e->parent, k);
+    int i = 0;
+    if (n->bitmap == 0) {
+        while (!lval_eq(n->kids[i]->key, k)) {
+            i++;
+        }
+        n = lmap_node_own(n);
+        lmap_node_del(n->kids[i]);
+        n->kids[i] = NULL;
     } else {
-        return lval_err("unbound symbol '%s'", k->sym);
+        unsigned int bit = 1u << ((h >> shift) & ((1 << MAP_BITS) - 1));
+        i = __builtin_popcount(n->bitmap & (bit - 1));
+        n = lmap_node_own(n);
+        n->kids[i] = lmap_dissoc(n->kids[i], shift + MAP_BITS, h, k);
+        if (n->kids[i] == NULL) {
+            n->bitmap &= ~bit;
+        }
+    }
+    if (n->kids[i] == NULL) {
+        memmove(&n->kids[i], &n->kids[i + 1], sizeof(lmap_node*) * (n->count - i - 1));
+        n->count--;
+    }
+
+    if (n->count == 0 || (n->count == 1 && (n->kids[0]->key || n->kids[0]->bitmap == 0))) {
+        lmap_node* x = n->count ? n->kids[0] : NULL;
+        if (x) {
+            x->refs++;
+        }
+        lmap_node_del(n);
+        return x;
+    }
+    return n;
+}
+
+/* takes ownership of k & v */
+void lmap_put(lmap* m, lval* k, lval* v) {
+    int added = 0;
+    m->root = lmap_assoc(m->root, 0, lval_hash(k), k, v, &added);
+    m->count += added;
+}
+
+int lmap_remove(lmap* m, lval* k) {
+    unsigned long h = lval_hash(k);
+    if (lmap_find(m, k, h) == NULL) {
+        return 0;
+    }
+    m->root = lmap_dissoc(m->root, 0, h, k);
+    m->count--;
+    return 1;
+}
+
+long lmap_collect(lmap_node* n, lmap_node** out, long i) {
+    if (n->key) {
+        out[i++] = n;
+        return i;
+    }
+    for (int j = 0; j < n->count; j++) {
+        i = lmap_collect(n->kids[j], out, i);
+    }
+    return i;
+}
+
+/* the count leaves under root, for walking a map in a loop; they live
+ * as long as root does */
+lmap_node** lmap_leaves(lmap_node* root, long count) {
+    lmap_node** out = malloc(sizeof(lmap_node*) * (count ? count : 1));
+    if (root) {
+        lmap_collect(root, out, 0);
+    }
+    return out;
+}
+
+larr* larr_new(long count) {
+    larr* a = malloc(sizeof(larr));
+    a->refs = 1;
+    a->count = count;
+    a->data = malloc(sizeof(long) * (count ? count : 1));
+    return a;
+}
+
+void larr_del(larr* a) {
+    if (--a->refs > 0) {
+        return;
+    }
+    free(a->data);
+    free(a);
+}
+
+lvec* lvec_new(long cap) {
+    lvec* v = malloc(sizeof(lvec));
+    v->refs = 1;
+    v->count = 0;
+    v->cap = cap < 4 ? 4 : cap;
+    v->items = malloc(sizeof(lval*) * v->cap);
+    return v;
+}
+
+void lvec_del(lvec* v) {
+    if (--v->refs > 0) {
+        return;
+    }
+    for (long i = 0; i < v->count; i++) {
+        lval_del(v->items[i]);
+    }
+    free(v->items);
+    free(v);
+}
+
+/* takes ownership of x, doubling the storage when full */
+void lvec_push(lvec* v, lval* x) {
+    if (v->count == v->cap) {
+        v->cap *= 2;
+        v->items = realloc(v->items, sizeof(lval*) * v->cap);
+    }
+    v->items[v->count++] = x;
+}
+
+long lval_vec_len(lval* v) {
+    return v->vec_len;
+}
+
+void lfun_del(lfun* f) {
+    if (--f->refs > 0) {
+        return;
+    }
+    lval_del(f->formals);
+    lval_del(f->body);
+    if (f->self) { lval_del(f->self); }
+    free(f);
+}
+
+/* cap bounds the number of entries, 0 for no bound */
+lmemo* lmemo_new(lval* fn, long cap) {
+    lmemo* m = calloc(1, sizeof(lmemo));
+    m->refs = 1;
+    m->fn = fn;
+    m->cap = cap;
+    m->nbuckets = 64;
+    m->buckets = calloc(m->nbuckets, sizeof(lmemo_entry*));
+    return m;
+}
+
+void lmemo_del(lmemo* m) {
+    if (--m->refs > 0) {
+        return;
+    }
+
+    lmemo_entry* x = m->head;
+    while (x) {
+        lmemo_entry* next = x->next;
+        lval_del(x->args);
+        lval_del(x->val);
+        free(x);
+        x = next;
+    }
+    lval_del(m->fn);
+    free(m->buckets);
+    free(m);
+}
+
+/* detaches x from the recently used list, leaving its bucket alone */
+void lmemo_unlink(lmemo* m, lmemo_entry* x) {
+    if (x->prev) { x->prev->next = x->next; } else { m->head = x->next; }
+    if (x->next) { x->next->prev = x->prev; } else { m->tail = x->prev; }
+    x->prev = x->next = NULL;
+}
+
+/* drops the least recently used entry */
+void lmemo_evict(lmemo* m) {
+    lmemo_entry* x = m->tail;
+    lmemo_unlink(m, x);
+
+    lmemo_entry** p = &m->buckets[x->hash & (m->nbuckets - 1)];
+    while (*p != x) {
+        p = &(*p)->chain;
+    }
+    *p = x->chain;
+
+    lval_del(x->args);
+    lval_del(x->val);
+    free(x);
+    m->count--;
+    m->evictions++;
+}
+
+/* looks the arguments up before calling through, errors aren't cached
+ * so a failing call is retried next time */
+lval* lmemo_call(lenv* e, lmemo* m, lval* a) {
+    unsigned long h = lval_hash(a);
+    for (lmemo_entry* x = m->buckets[h & (m->nbuckets - 1)]; x; x = x->chain) {
+        if (x->hash == h && lval_eq(x->args, a)) {
+            m->hits++;
+            if (x != m->head) {
+                lmemo_unlink(m, x);
+                x->next = m->head;
+                m->head->prev = x;
+                m->head = x;
+            }
+            lval_del(a);
+            return lval_copy(x->val);
+        }
+    }
+
+    m->misses++;
+    a->hash = 0;
+    lval* args = lval_copy(a);
+    lval* r = lval_apply(e, m->fn, a);
+    if (r->type == LVAL_ERR) {
+        lval_del(args);
+        return r;
+    }
+
+    if (m->count >= m->nbuckets) {
+        long n = m->nbuckets * 2;
+        lmemo_entry** buckets = calloc(n, sizeof(lmemo_entry*));
+        for (lmemo_entry* x = m->head; x; x = x->next) {
+            x->chain = buckets[x->hash & (n - 1)];
+            buckets[x->hash & (n - 1)] = x;
+        }
+        free(m->buckets);
+        m->buckets = buckets;
+        m->nbuckets = n;
+    }
+
+    lmemo_entry* x = calloc(1, sizeof(lmemo_entry));
+    x->hash = h;
+    x->args = args;
+    x->val = lval_copy(r);
+    x->chain = m->buckets[h & (m->nbuckets - 1)];
+    m->buckets[h & (m->nbuckets - 1)] = x;
+    x->next = m->head;
+    if (m->head) { m->head->prev = x; } else { m->tail = x; }
+    m->head = x;
+    m->count++;
+
+    if (m->cap && m->count > m->cap) {
+        lmemo_evict(m);
+    }
+    return r;
+}
+
+/* lenv helpers */
+
+/* the value k is bound to without copying it, NULL if unbound */
+lval* lenv_find(lenv* e, lval* k) {
+    for (lenv* f = e; f; f = f->parent) {
+        int i = lenv_index(f, k);
+        if (i >= 0) {
+            return f->vals[i];
+        }
+        /* a module's lambdas see what the module defines before
+         * anything their callers have bound */
+        if (f->module) {
+            i = lenv_index(f->module, k);
+            if (i >= 0) {
+                return f->module->vals[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+    lval* v = lenv_find(e, k);
+    if (v == NULL) {
+        return lval_err_code(LERR_UNBOUND, k->sym, 0, 0, 0);
     }
+    return lval_copy(v);
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
     for (int i = 0; i < e->count; i++) {
         if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            e->syms[i] = realloc(e->syms[i], strlen(k->sym) + 1);
-            strcpy(e->syms[i], k->sym);
+            lenv_set(e, i, lval_copy(v));
             return;
         }
     }
@@ -173,32 +779,91 @@ void lenv_put(lenv* e, lval* k, lval* v) {
     e->vals[e->count - 1] = lval_copy(v);
     e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
     strcpy(e->syms[e->count - 1], k->sym);
+    lbuiltin_shadow(k->sym, NULL, v);
+}
+
+/* like lenv_put but takes ownership of v */
+void lenv_bind(lenv* e, lval* k, lval* v) {
+    int i = lenv_index(e, k);
+    if (i >= 0) {
+        lenv_set(e, i, v);
+        return;
+    }
+
+    e->count++;
+    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+    e->syms = realloc(e->syms, sizeof(char*) * e->count);
+
+    e->vals[e->count - 1] = v;
+    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
+    strcpy(e->syms[e->count - 1], k->sym);
+    lbuiltin_shadow(k->sym, NULL, v);
+}
+
+/* rebinds e's slot i to v, taking ownership of v & returning what it
+ * was bound to. Bindings only change through here, lenv_set, lenv_put,
+ * lenv_bind & lenv_drop so the shadowed builtins stay counted */
+lval* lenv_swap(lenv* e, int i, lval* v) {
+    lval* old = e->vals[i];
+    lbuiltin_shadow(e->syms[i], old, v);
+    e->vals[i] = v;
+    return old;
+}
+
+void lenv_set(lenv* e, int i, lval* v) {
+    lval_del(lenv_swap(e, i, v));
 }
 
+/* frees e's slot i, leaving a hole for the caller to close */
+void lenv_drop(lenv* e, int i) {
+    lbuiltin_shadow(e->syms[i], e->vals[i], NULL);
+    free(e->syms[i]);
+    lval_del(e->vals[i]);
+}
+
+/* defines in the enclosing module, or globally outside of one */
 void lenv_def(lenv* e, lval* k, lval* v) {
-    while (e->parent) {
+    while (e->parent && !e->namespace) {
         e = e->parent;
     }
     lenv_put(e, k, v);
 }
 
-lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
-    n->parent = e->parent;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
-    for (int i = 0; i < n->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+/* the module namespace e is in, NULL at the top level */
+lenv* lenv_namespace(lenv* e) {
+    while (e && !e->namespace) {
+        e = e->parent;
     }
-    return n;
+    return e;
+}
+
+int lenv_index(lenv* e, lval* k) {
+    for (int i = 0; i < e->count; i++) {
+        if (strcmp(e->syms[i], k->sym) == 0) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 /* lval helpers */
 
+/* drops what was cached or analysed about v before its cells change */
+void lval_forget(lval* v) {
+    v->hash = 0;
+    v->site = NULL;
+    if (v->native) {
+        lnum_del(v->native);
+        v->native = NULL;
+    }
+    if (v->cases) {
+        lcase_del(v->cases);
+        v->cases = NULL;
+    }
+}
+
 lval* lval_add(lval* v, lval* x) {
+    lval_forget(v);
     v->count++;
     v->cell = realloc(v->cell, sizeof(lval*) * v->count);
     v->cell[v->count - 1] = x;
@@ -206,13 +871,27 @@ lval* lval_add(lval* v, lval* x) {
 }
 
 lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
+    if (v->interned) {
+        return v;
+    }
+
+    lval* x = lval_alloc();
     x->type = v->type;
+    x->hash = v->hash;
 
     switch(v->type) {
         case LVAL_ERR:
-            x->err = malloc(strlen(v->err) + 1);
-            strcpy(x->err, v->err);
+            x->err_code = v->err_code;
+            x->err_func = v->err_func;
+            memcpy(x->err_arg, v->err_arg, sizeof(v->err_arg));
+            if (v->err) {
+                x->err = malloc(strlen(v->err) + 1);
+                strcpy(x->err, v->err);
+            }
+            if (v->sym) {
+                x->sym = malloc(strlen(v->sym) + 1);
+                strcpy(x->sym, v->sym);
+            }
             break;
         case LVAL_NUM:
         case LVAL_BOOL:
@@ -228,19 +907,50 @@ lval* lval_copy(lval* v) {
             break;
         case LVAL_FUN:
             x->builtin = v->builtin;
-            if (x->builtin == NULL) {
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
+            x->memo = v->memo;
+            if (x->memo) {
+                x->memo->refs++;
+            } else if (x->builtin == NULL) {
+                x->fun = v->fun;
+                x->fun->refs++;
+                x->macro = v->macro;
+                x->count = v->count;
+                x->cell = malloc(sizeof(lval*) * x->count);
+                for (int i = 0; i < x->count; i++) {
+                    x->cell[i] = lval_copy(v->cell[i]);
+                }
             }
             break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
+        case LVAL_RECUR:
             x->count = v->count;
             x->cell = malloc(sizeof(lval*) * x->count);
             for (int i = 0; i < x->count; i++) {
                 x->cell[i] = lval_copy(v->cell[i]);
             }
+            x->native = v->native;
+            if (x->native) { x->native->refs++; }
+            x->site = v->site;
+            x->cases = v->cases;
+            if (x->cases) { x->cases->refs++; }
+            break;
+        case LVAL_SEQ:
+            x->seq = lseq_copy(v->seq);
+            break;
+        case LVAL_MAP:
+            x->map = v->map;
+            x->map->refs++;
+            break;
+        case LVAL_ARR:
+            x->arr = v->arr;
+            x->arr->refs++;
+            break;
+        case LVAL_VEC:
+            x->vec = v->vec;
+            x->vec->refs++;
+            x->vec_off = v->vec_off;
+            x->vec_len = v->vec_len;
             break;
     }
 
@@ -273,7 +983,9 @@ lval* lval_read(mpc_ast_t* t) {
         return lval_sym(t->contents);
     }
     if (strstr(t->tag, "string")) {
-        return lval_read_str(t);
+        lval* x = lval_read_str(t);
+        lval_hash(x);
+        return x;
     }
 
     lval* x = NULL;
@@ -309,32 +1021,198 @@ lval* lval_read(mpc_ast_t* t) {
         x = lval_add(x, lval_read(t->children[i]));
     }
 
+    /* literals are immutable until copied, so hash them up front */
+    if (x->type == LVAL_QEXPR) {
+        lval_hash(x);
+        x = lval_intern(x);
+    }
     return x;
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
+/* an unshared copy of an interned list for the caller to mutate, its
+ * interned items stay shared */
+lval* lval_own(lval* v) {
+    if (!v->interned) {
+        return v;
+    }
+
+    lval* x = lval_qexpr();
+    x->hash = v->hash;
+    x->count = v->count;
+    x->cell = malloc(sizeof(lval*) * v->count);
     for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
-        if (i != (v->count - 1)) {
-            putchar(' ');
-        }
+        x->cell[i] = lval_copy(v->cell[i]);
     }
-    putchar(close);
+    return x;
 }
 
-void lval_print_str(lval* v) {
-    char* escaped = malloc(strlen(v->str) + 1);
+/* builtins are free to mutate their arguments, so give them owned ones */
+lval* lval_own_cells(lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        a->cell[i] = lval_own(a->cell[i]);
+    }
+    return a;
+}
+
+/* returns the shared copy of a quoted literal, only lists of atoms &
+ * other interned lists qualify as nothing inside them gets evaluated */
+lval* lval_intern(lval* v) {
+    lintern_table* t = &intern_table;
+    if (!t->enabled || v->type != LVAL_QEXPR) {
+        return v;
+    }
+    for (int i = 0; i < v->count; i++) {
+        switch (v->cell[i]->type) {
+            case LVAL_NUM:
+            case LVAL_BOOL:
+            case LVAL_SYM:
+            case LVAL_STR:
+                break;
+            case LVAL_QEXPR:
+                if (v->cell[i]->interned) {
+                    break;
+                }
+                return v;
+            default:
+                return v;
+        }
+    }
+
+    if (2 * (t->count + 1) > t->cap) {
+        long cap = t->cap ? t->cap * 2 : 1024;
+        lval** items = calloc(cap, sizeof(lval*));
+        for (long i = 0; i < t->cap; i++) {
+            if (t->items[i]) {
+                long j = t->items[i]->hash & (cap - 1);
+                while (items[j]) {
+                    j = (j + 1) & (cap - 1);
+                }
+                items[j] = t->items[i];
+            }
+        }
+        free(t->items);
+        t->items = items;
+        t->cap = cap;
+    }
+
+    unsigned long h = lval_hash(v);
+    long i = h & (t->cap - 1);
+    while (t->items[i]) {
+        if (t->items[i]->hash == h && lval_eq(t->items[i], v)) {
+            lval_del(v);
+            return t->items[i];
+        }
+        i = (i + 1) & (t->cap - 1);
+    }
+
+    v->interned = 1;
+    t->items[i] = v;
+    t->count++;
+    return v;
+}
+
+void lval_expr_print(lval* v, char open, char close) {
+    putchar(open);
+    for (int i = 0; i < v->count; i++) {
+        lval_print(v->cell[i]);
+        if (i != (v->count - 1)) {
+            putchar(' ');
+        }
+    }
+    putchar(close);
+}
+
+void lval_print_str(lval* v) {
+    char* escaped = malloc(strlen(v->str) + 1);
     strcpy(escaped, v->str);
     escaped = mpcf_escape(escaped);
     printf("\"%s\"", escaped);
     free(escaped);
 }
 
+void lval_map_print(lval* v) {
+    lmap* m = v->map;
+    lmap_node** xs = lmap_leaves(m->root, m->count);
+
+    printf("#{");
+    for (long i = 0; i < m->count; i++) {
+        if (i) {
+            putchar(' ');
+        }
+        lval_print(xs[i]->key);
+        putchar(' ');
+        lval_print(xs[i]->val);
+    }
+    putchar('}');
+    free(xs);
+}
+
+void lval_arr_print(lval* v) {
+    printf("#[");
+    for (long i = 0; i < v->arr->count; i++) {
+        if (i) {
+            putchar(' ');
+        }
+        printf("%li", v->arr->data[i]);
+    }
+    putchar(']');
+}
+
+void lval_vec_print(lval* v) {
+    long n = lval_vec_len(v);
+    putchar('[');
+    for (long i = 0; i < n; i++) {
+        if (i) {
+            putchar(' ');
+        }
+        lval_print(v->vec->items[v->vec_off + i]);
+    }
+    putchar(']');
+}
+
+char* lval_err_msg(lval* v) {
+    if (v->err) {
+        return v->err;
+    }
+
+    char buf[ERROR_BUFFER_LEN];
+    long* n = v->err_arg;
+    switch (v->err_code) {
+        case LERR_ARGS:
+            snprintf(buf, ERROR_BUFFER_LEN,
+                     "'%s' incorrect number of arguments received, expected %li, got %li",
+                     v->err_func, n[0], n[1]);
+            break;
+        case LERR_ARGS_MIN:
+            snprintf(buf, ERROR_BUFFER_LEN,
+                     "'%s' not enough arguments, expected %li, got %li",
+                     v->err_func, n[0], n[1]);
+            break;
+        case LERR_TYPE:
+            snprintf(buf, ERROR_BUFFER_LEN,
+                     "'%s' incorrect type for arg %li, expected %s, got %s",
+                     v->err_func, n[0], ltype_name(n[1]), ltype_name(n[2]));
+            break;
+        case LERR_UNBOUND:
+            snprintf(buf, ERROR_BUFFER_LEN, "unbound symbol '%s'", v->sym);
+            break;
+        case LERR_DIV_ZERO:
+            snprintf(buf, ERROR_BUFFER_LEN, "division by zero");
+            break;
+        default:
+            buf[0] = '\0';
+            break;
+    }
+
+    v->err = malloc(strlen(buf) + 1);
+    strcpy(v->err, buf);
+    return v->err;
+}
+
 void lval_print(lval* v) {
     switch(v->type) {
         case LVAL_ERR:
-            printf("Error: %s", v->err);
+            printf("Error: %s", lval_err_msg(v));
             break;
         case LVAL_NUM:
             printf("%li", v->num);
@@ -353,14 +1231,25 @@ void lval_print(lval* v) {
             lval_print_str(v);
             break;
         case LVAL_FUN:
-            if (v->builtin) {
+            if (v->memo) {
+                printf("(memo ");
+                lval_print(v->memo->fn);
+                putchar(')');
+            } else if (v->builtin) {
                 printf("<builtin>");
             } else {
-                printf("(\\ ");
-                lval_print(v->formals);
+                /* a partial application prints as the call it stands for */
+                if (v->count) { putchar('('); }
+                printf(v->macro ? "(macro " : "(\\ ");
+                lval_print(v->fun->formals);
                 putchar(' ');
-                lval_print(v->body);
+                lval_print(v->fun->body);
                 putchar(')');
+                for (int i = 0; i < v->count; i++) {
+                    putchar(' ');
+                    lval_print(v->cell[i]);
+                }
+                if (v->count) { putchar(')'); }
             }
             break;
         case LVAL_SEXPR:
@@ -369,6 +1258,21 @@ void lval_print(lval* v) {
         case LVAL_QEXPR:
             lval_expr_print(v, '{', '}');
             break;
+        case LVAL_RECUR:
+            printf("<recur>");
+            break;
+        case LVAL_SEQ:
+            printf("<seq>");
+            break;
+        case LVAL_MAP:
+            lval_map_print(v);
+            break;
+        case LVAL_ARR:
+            lval_arr_print(v);
+            break;
+        case LVAL_VEC:
+            lval_vec_print(v);
+            break;
     }
 }
 
@@ -381,6 +1285,7 @@ lval* lval_pop(lval* v, int i) {
     lval* x = v->cell[i];
     memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count - i - 1));
     v->count--;
+    lval_forget(v);
     v->cell = realloc(v->cell, sizeof(lval*) * v->count);
     return x;
 }
@@ -392,23 +1297,92 @@ lval* lval_take(lval* v, int i) {
 }
 
 lval* lval_join(lval* x, lval* y) {
-    while(y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+    if (y->count) {
+        x->cell = realloc(x->cell, sizeof(lval*) * (x->count + y->count));
+        memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count);
+        x->count += y->count;
+        lval_forget(x);
+        y->count = 0;
     }
     lval_del(y);
     return x;
 }
 
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+    /* analysed code goes its own way, so code that wasn't only pays for
+     * this one test */
+    if (v->native || v->site) {
+        return lval_eval_proven(e, v);
+    }
+
+    v->hash = 0;
+    /* stop at the first error, the cells after it are never evaluated */
     for (int i = 0; i < v->count; i++) {
         v->cell[i] = lval_eval(e, v->cell[i]);
+        if (v->cell[i]->type == LVAL_ERR) {
+            return lval_take(v, i);
+        }
+    }
+    return lval_eval_call(e, v);
+}
+
+/* whether what was proven of v when it was analysed still holds, which
+ * is while none of the builtins it was checked against has its name
+ * rebound: the one it calls and those giving its arguments' types */
+int lval_proven_holds(lval* v) {
+    if (v->native) {
+        return lnum_holds(v->native);
+    }
+    for (int i = 0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        if (i > 0 && (x->type != LVAL_SEXPR || x->count == 0)) {
+            continue;
+        }
+        if (lbuiltin_shadowed(i > 0 ? x->cell[0] : x)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* v with its native tree or proven site. Both fixed the builtins they
+ * call when they were analysed, so once one of those names is rebound
+ * v is evaluated as code that was never analysed */
+lval* lval_eval_proven(lenv* e, lval* v) {
+    if (builtins_shadowed && !lval_proven_holds(v)) {
+        lval_forget(v);
+        return lval_eval_sexpr(e, v);
+    }
+    if (v->native) {
+        return lnum_run(e, v);
     }
+
+    lbuiltin_desc* site = v->site;
+    if (site->fused) {
+        lval* r = site->fused(e, v);
+        if (r) {
+            return r;
+        }
+    }
+    v->hash = 0;
     for (int i = 0; i < v->count; i++) {
+        v->cell[i] = lval_eval(e, v->cell[i]);
         if (v->cell[i]->type == LVAL_ERR) {
             return lval_take(v, i);
         }
     }
 
+    /* a proven call skips the checks the descriptor covers */
+    lval* f = v->cell[0];
+    if (site->fast && f->type == LVAL_FUN && f->builtin == site->fn) {
+        lval_del(lval_pop(v, 0));
+        return site->fast(e, lval_own_cells(v));
+    }
+    return lval_eval_call(e, v);
+}
+
+/* calls the head of v on the rest, its cells already evaluated */
+lval* lval_eval_call(lenv* e, lval* v) {
     if (v->count == 0) {
         return v;
     }
@@ -425,555 +1399,4754 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
         return err;
     }
 
+    /* f is ours, so a partial application's bound arguments can be
+     * moved to the front of the call rather than copied */
+    if (f->fun && f->count) {
+        v->cell = realloc(v->cell, sizeof(lval*) * (v->count + f->count));
+        memmove(&v->cell[f->count], v->cell, sizeof(lval*) * v->count);
+        memcpy(v->cell, f->cell, sizeof(lval*) * f->count);
+        v->count += f->count;
+        f->count = 0;
+    }
+
     lval* result = lval_call(e, f, v);
     lval_del(f);
     return result;
 }
 
-lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        return lenv_get(e, v);
-    }
-    if (v->type == LVAL_SEXPR) {
-        return lval_eval_sexpr(e, v);
-    }
-    return v;
+/* the macro k is bound to, looked up without copying */
+lval* lval_macro_find(lenv* e, lval* k) {
+    lval* m = lenv_find(e, k);
+    return m && m->type == LVAL_FUN && m->macro ? m : NULL;
 }
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    if (f->builtin) { return f->builtin(e, a); }
-
-    int given = a->count;
-    int total = f->formals->count;
 
-    while (a->count) {
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err("function passed too many arguments. Got %i, Expected %i.", given, total);
+/* a copy of v with each formal replaced by its argument, the symbol
+ * after '&' by a list of the rest */
+lval* lval_subst(lval* v, lval* formals, lval* args) {
+    if (v->type == LVAL_SYM) {
+        for (int i = 0; i < formals->count; i++) {
+            char* sym = formals->cell[i]->sym;
+            if (strcmp(sym, "&") == 0) {
+                if (strcmp(v->sym, formals->cell[i + 1]->sym) == 0) {
+                    lval* xs = lval_qexpr();
+                    for (int j = i; j < args->count; j++) {
+                        xs = lval_add(xs, lval_copy(args->cell[j]));
+                    }
+                    return xs;
+                }
+                break;
+            }
+            if (strcmp(v->sym, sym) == 0) {
+                return lval_copy(args->cell[i]);
+            }
         }
+        return lval_copy(v);
+    }
 
-        lval* sym = lval_pop(f->formals, 0);
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        lval* x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+        x->count = v->count;
+        x->cell = malloc(sizeof(lval*) * v->count);
+        for (int i = 0; i < v->count; i++) {
+            x->cell[i] = lval_subst(v->cell[i], formals, args);
+        }
+        return x;
+    }
 
-        if (strcmp(sym->sym, "&") == 0) {
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err("function format invalid. Symbol '&' not followed by single symbol.");
-            }
+    return lval_copy(v);
+}
 
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
+/* instantiates m's template over args as a list of the given type */
+lval* lval_macro_apply(lval* m, lval* args, int type) {
+    lval* formals = m->fun->formals;
+    int rest = -1;
+    for (int i = 0; i < formals->count; i++) {
+        if (strcmp(formals->cell[i]->sym, "&") == 0) {
+            rest = i;
             break;
         }
+    }
 
-        lval* val = lval_pop(a, 0);
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+    if (rest < 0 ? args->count != formals->count : args->count < rest) {
+        lval* err = lval_err("macro expected %s%d arguments, got %d",
+                             rest < 0 ? "" : "at least ",
+                             rest < 0 ? formals->count : rest, args->count);
+        lval_del(args);
+        return err;
     }
 
-    lval_del(a);
+    lval* x = lval_subst(m->fun->body, formals, args);
+    x->type = type;
+    lval_del(args);
+    return x;
+}
 
-    if (f->formals->count > 0 &&
-        strcmp(f->formals->cell[0]->sym, "&") == 0) {
-        if (f->formals->count != 2) {
-            return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+/* whether k is the formal of a lambda in s */
+int lscope_has(lscope* s, lval* k) {
+    for (; s; s = s->up) {
+        for (int i = 0; i < s->formals->count; i++) {
+            if (strcmp(s->formals->cell[i]->sym, k->sym) == 0) {
+                return 1;
+            }
         }
-
-        lval_del(lval_pop(f->formals, 0));
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
     }
+    return 0;
+}
 
-    if (f->formals->count == 0) {
-        f->env->parent = e;
-        return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        return lval_copy(f);
+/* expands every (macro ...) form in v. Q-Expressions are only looked
+ * inside where they run as code (lval_is_code), any other is data and
+ * kept as written. s holds the formals of the lambdas v is in, which
+ * are never macros there; interned lists have no S-Expressions in them
+ * so they're skipped */
+lval* lval_expand(lenv* e, lval* v, lscope* s) {
+    if (macro_count == 0 || v->interned) {
+        return v;
+    }
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+        return v;
     }
-}
 
-int lval_eq(lval* x, lval* y) {
-    if (x->type != y->type) {
-        return 0;
+    lbuiltin fn = NULL;
+    if (v->type == LVAL_SEXPR && v->count) {
+        lval* k = v->cell[0];
+        int bound = k->type == LVAL_SYM && lscope_has(s, k);
+        lval* m = k->type == LVAL_SYM && !bound ? lval_macro_find(e, k) : NULL;
+        if (m) {
+            lval_del(lval_pop(v, 0));
+            return lval_expand(e, lval_macro_apply(m, v, LVAL_SEXPR), s);
+        }
+        fn = bound ? NULL : lval_head_builtin(e, v);
     }
 
-    switch (x->type) {
-        case LVAL_ERR:
-            return (strcmp(x->err, y->err) == 0);
-        case LVAL_NUM:
-        case LVAL_BOOL:
-            return (x->num == y->num);
-        case LVAL_SYM:
-            return (strcmp(x->sym, y->sym) == 0);
-        case LVAL_STR:
-            return (strcmp(x->str, y->str) == 0);
-        case LVAL_FUN:
-            if (x->builtin) {
-                return x->builtin == y->builtin;
-            } else {
-                return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
-            }
-        case LVAL_SEXPR:
-        case LVAL_QEXPR:
-            if (x->count != y->count) {
-                return 0;
-            }
-            for (int i = 0; i < x->count; i++) {
-                if (!lval_eq(x->cell[0], y->cell[0])) {
-                    return 0;
-                }
+    /* a lambda's body has its formals in scope, when they're written out
+     * here; otherwise it's left until the lambda is made */
+    lscope inner = { NULL, s };
+    for (int i = 0; i < v->count; i++) {
+        lval* c = v->cell[i];
+        if (c->type != LVAL_SEXPR && c->type != LVAL_QEXPR) {
+            continue;
+        }
+        if (c->type == LVAL_QEXPR && !lval_is_code(fn, v, i)) {
+            continue;
+        }
+        lscope* cs = s;
+        if (fn == builtin_lambda && i == 2) {
+            if (v->cell[1]->type != LVAL_QEXPR) {
+                continue;
             }
-            return 1;
+            inner.formals = v->cell[1];
+            cs = &inner;
+        }
+        unsigned long h = c->hash;
+        v->cell[i] = lval_expand(e, c, cs);
+        if (v->cell[i] != c || v->cell[i]->hash != h) {
+            v->hash = 0;
+        }
     }
-
-    return 0;
+    return v;
 }
 
-char* ltype_name(int t) {
-    switch(t) {
-        case LVAL_ERR:
-            return "Error";
-            break;
-        case LVAL_NUM:
-            return "Number";
-            break;
-        case LVAL_BOOL:
-            return "Bool";
-            break;
-        case LVAL_SYM:
-            return "Symbol";
-            break;
-        case LVAL_STR:
-            return "String";
-            break;
-        case LVAL_FUN:
-            return "Function";
-            break;
-        case LVAL_SEXPR:
-            return "S-Expression";
-            break;
-        case LVAL_QEXPR:
-            return "Q-Expression";
-            break;
-        default:
-            return "Unknown";
+lval* lval_eval(lenv* e, lval* v) {
+    if (v->type == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    }
+    if (v->type == LVAL_SEXPR) {
+        return profile.enabled ? lprof_eval_sexpr(e, v) : lval_eval_sexpr(e, v);
     }
+    return v;
 }
 
-/* builtins */
-
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
+/* takes the Q-Expression v as code a loop runs over and over, so it's
+ * analysed once up front as eval would, rather than on each pass */
+lval* lval_loop_code(lenv* e, lval* v) {
+    lval* x = lval_own(v);
+    x->type = LVAL_SEXPR;
+    x->hash = 0;
+    leval_prepare(e, x);
+    return x;
 }
 
-lval* builtin_head(lenv* e, lval* a) {
-    LASSERT_NUM("head", a, 1);
-    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-    LASSERT(a, (a->cell[0]->count != 0),
-            "'head' passed {}");
-
-    lval* v = lval_take(a, 0);
-    while(v->count > 1) {
-        lval_del(lval_pop(v, 1));
+lval* lval_eval_copy(lenv* e, lval* v) {
+    /* a readonly native tree runs straight off v, unless profiling wants
+     * to see it evaluated */
+    if (v->native && v->native->readonly && !profile.enabled &&
+        (!builtins_shadowed || lnum_holds(v->native))) {
+        return lnum_value(e, v);
     }
-    return v;
+    /* so does a compiled case, rather than copying every clause. It
+     * checks its head itself and its keys are literals */
+    lval* r = v->cases && !profile.enabled ? lcase_value(e, v) : NULL;
+    if (r) {
+        return r;
+    }
+    lval* x = lval_own(lval_copy(v));
+    x->type = LVAL_SEXPR;
+    x->hash = 0;
+    return lval_eval(e, x);
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-    LASSERT_NUM("tail", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-    LASSERT(a, (a->cell[0]->count != 0),
-            "'tail' passed {}");
+/* like lval_call but leaves f untouched, for builtins applying a
+ * function argument more than once */
+lval* lval_apply(lenv* e, lval* f, lval* a) {
+    if (f->builtin) { return f->builtin(e, lval_own_cells(a)); }
+    return lval_call(e, f, a);
+}
 
-    lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
+/* the i-th item of l as 'fst' would see it, i.e. evaluated */
+lval* lval_item(lenv* e, lval* l, int i) {
+    return lval_eval(e, lval_own(lval_copy(l->cell[i])));
 }
 
-lval* builtin_init(lenv* e, lval* a) {
-    LASSERT_NUM("init", a, 1);
-    LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
-    LASSERT(a, (a->cell[0]->count != 0),
-            "'init' passed {}");
+/* pulls the next item through the chain of stages, NULL once the
+ * sequence is exhausted */
+lval* lseq_next(lenv* e, lseq* s) {
+    lval* x;
+    lval* r;
 
-    lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, v->count - 1));
-    return v;
-}
+    switch (s->kind) {
+        case LSEQ_RANGE:
+            if ((s->step > 0 && s->cur >= s->end) ||
+                (s->step < 0 && s->cur <= s->end)) {
+                return NULL;
+            }
+            x = lval_num(s->cur);
+            s->cur += s->step;
+            return x;
 
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT_NUM("eval", a, 1);
-    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+        case LSEQ_LIST:
+            if (s->cur >= s->list->count) {
+                return NULL;
+            }
+            return lval_item(e, s->list, s->cur++);
 
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
-}
+        case LSEQ_MAP:
+            x = lseq_next(e, s->src);
+            if (x == NULL || x->type == LVAL_ERR) {
+                return x;
+            }
+            return lval_apply(e, s->fn, lval_add(lval_sexpr(), x));
 
-lval* builtin_join(lenv* e, lval* a) {
-    for (int i = 0; i < a->count; i++) {
+        case LSEQ_FILTER:
+        case LSEQ_TAKEWHILE:
+            if (s->done) {
+                return NULL;
+            }
+            while ((x = lseq_next(e, s->src))) {
+                if (x->type == LVAL_ERR) {
+                    return x;
+                }
+
+                r = lval_apply(e, s->fn, lval_add(lval_sexpr(), lval_copy(x)));
+                if (r->type != LVAL_BOOL) {
+                    lval* err = r;
+                    if (r->type != LVAL_ERR) {
+                        err = lval_err("sequence predicate must return %s, got %s",
+                                       ltype_name(LVAL_BOOL), ltype_name(r->type));
+                        lval_del(r);
+                    }
+                    lval_del(x);
+                    return err;
+                }
+
+                int keep = r->num;
+                lval_del(r);
+                if (keep) {
+                    return x;
+                }
+                lval_del(x);
+                if (s->kind == LSEQ_TAKEWHILE) {
+                    s->done = 1;
+                    return NULL;
+                }
+            }
+            return NULL;
+
+        case LSEQ_TAKE:
+            if (s->cur <= 0) {
+                return NULL;
+            }
+            s->cur--;
+            return lseq_next(e, s->src);
+    }
+
+    return NULL;
+}
+
+/* head, tail & empty? only need the first item of a sequence, so they
+ * step it once rather than collecting it. Each takes its arguments */
+lval* lseq_head(lenv* e, lval* a) {
+    lval* x = lseq_next(e, a->cell[0]->seq);
+    lval_del(a);
+    if (x == NULL) {
+        return lval_err("'head' passed {}");
+    }
+    return x->type == LVAL_ERR ? x : lval_add(lval_qexpr(), x);
+}
+
+/* the sequence itself, one item on */
+lval* lseq_tail(lenv* e, lval* a) {
+    lval* x = lseq_next(e, a->cell[0]->seq);
+    if (x == NULL || x->type == LVAL_ERR) {
+        lval_del(a);
+        return x ? x : lval_err("'tail' passed {}");
+    }
+    lval_del(x);
+    return lval_take(a, 0);
+}
+
+lval* lseq_empty(lenv* e, lval* a) {
+    lval* x = lseq_next(e, a->cell[0]->seq);
+    lval_del(a);
+    if (x == NULL) {
+        return lval_bool(1);
+    }
+    if (x->type == LVAL_ERR) {
+        return x;
+    }
+    lval_del(x);
+    return lval_bool(0);
+}
+
+/* == (or != when eq is 0) where either side is a sequence, stepping
+ * it against the other side's items & stopping at the first that
+ * differs. A sequence equals a list or sequence of the same items */
+lval* lseq_eq(lenv* e, lval* a, int eq) {
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    if (x->type != LVAL_SEQ) {
+        x = a->cell[1];
+        y = a->cell[0];
+    }
+    if (y->type != LVAL_SEQ && y->type != LVAL_QEXPR) {
+        lval_del(a);
+        return lval_bool(!eq);
+    }
+
+    int r = 1;
+    for (int i = 0; r; i++) {
+        lval* p = lseq_next(e, x->seq);
+        lval* q = NULL;
+        if (p == NULL || p->type != LVAL_ERR) {
+            if (y->type == LVAL_SEQ) {
+                q = lseq_next(e, y->seq);
+            } else if (i < y->count) {
+                q = lval_copy(y->cell[i]);
+            }
+        }
+        lval* err = p && p->type == LVAL_ERR ? p : q && q->type == LVAL_ERR ? q : NULL;
+        if (err || p == NULL || q == NULL) {
+            r = p == NULL && q == NULL;
+            if (p && p != err) {
+                lval_del(p);
+            }
+            if (q && q != err) {
+                lval_del(q);
+            }
+            if (err) {
+                lval_del(a);
+                return err;
+            }
+            break;
+        }
+        r = lval_eq(p, q);
+        lval_del(p);
+        lval_del(q);
+    }
+
+    lval_del(a);
+    return lval_bool(r == eq);
+}
+
+/* materialises a sequence into a Q-Expression, anything else is
+ * returned untouched */
+lval* lval_force(lenv* e, lval* v) {
+    if (v->type != LVAL_SEQ) {
+        return v;
+    }
+
+    lval* r = lval_qexpr();
+    lval* x;
+    while ((x = lseq_next(e, v->seq))) {
+        if (x->type == LVAL_ERR) {
+            lval_del(r);
+            r = x;
+            break;
+        }
+        r = lval_add(r, x);
+    }
+
+    lval_del(v);
+    return r;
+}
+
+/* f is left untouched: given fewer arguments than formals it returns a
+ * partial application holding the arguments so far, otherwise the body
+ * is evaluated in a fresh frame */
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    if (f->builtin) { return f->builtin(e, lval_own_cells(a)); }
+    if (f->memo) { return lmemo_call(e, f->memo, a); }
+
+    /* a macro reached at run time, e.g. through eval, is expanded over
+     * its evaluated arguments */
+    if (f->macro) {
+        lval* r = lval_macro_apply(f, a, LVAL_SEXPR);
+        if (r->type == LVAL_ERR) {
+            return r;
+        }
+        return lval_eval(e, lval_expand(e, r, NULL));
+    }
+
+    lval* formals = f->fun->formals;
+    int total = formals->count;
+    int nargs = f->count + a->count;
+
+    int rest = -1;
+    for (int i = 0; i < total; i++) {
+        if (strcmp(formals->cell[i]->sym, "&") == 0) {
+            rest = i;
+            break;
+        }
+    }
+    int need = rest >= 0 ? rest : total;
+
+    if (rest >= 0 && rest != total - 2 && nargs >= need) {
+        lval_del(a);
+        return lval_err("function format invalid. Symbol '&' not followed by single symbol.");
+    }
+    if (rest < 0 && nargs > total) {
+        lval* err = lval_err("function passed too many arguments. Got %i, Expected %i.",
+                             a->count, total - f->count);
+        lval_del(a);
+        return err;
+    }
+
+    if (nargs < need) {
+        lval* p = lval_copy(f);
+        p->cell = realloc(p->cell, sizeof(lval*) * nargs);
+        memcpy(&p->cell[p->count], a->cell, sizeof(lval*) * a->count);
+        p->count = nargs;
+        a->count = 0;
+        lval_del(a);
+        return p;
+    }
+
+    lenv* frame = lenv_new();
+    frame->parent = e;
+    frame->module = f->fun->module;
+
+    for (int i = 0; i < need; i++) {
+        lval* val = i < f->count ? lval_copy(f->cell[i])
+                                 : a->cell[i - f->count];
+        lenv_bind(frame, formals->cell[i], val);
+    }
+    if (rest >= 0) {
+        lval* xs = lval_qexpr();
+        for (int i = need; i < nargs; i++) {
+            xs = lval_add(xs, i < f->count ? lval_copy(f->cell[i])
+                                           : a->cell[i - f->count]);
+        }
+        lenv_bind(frame, formals->cell[rest + 1], xs);
+    }
+    a->count = 0;
+    lval_del(a);
+
+    /* the body was analysed when the lambda was made, so this doesn't
+     * go through eval and its cache */
+    lval* r = f->fun->trmc
+        ? lval_trmc(frame, f->fun)
+        : lval_eval_copy(frame, f->fun->body);
+    lenv_del(frame);
+    return r;
+}
+
+/* runs a body {if c {base} {join x (self ...)}} as a loop in one frame:
+ * each level's x is kept and the formals are rebound to the recursive
+ * call's arguments, then everything is joined once at the end. Stack
+ * use is constant and the result is built in linear time */
+lval* lval_trmc(lenv* frame, lfun* fn) {
+    lval* body = fn->body;
+    lval* step = body->cell[fn->trmc];
+    lval* call = step->cell[2];
+    lval* formals = fn->formals;
+
+    int* idx = malloc(sizeof(int) * formals->count);
+    for (int i = 0; i < formals->count; i++) {
+        idx[i] = lenv_index(frame, formals->cell[i]);
+    }
+
+    lval* pieces = lval_sexpr();
+    lval* r;
+    while (1) {
+        /* if and join were only checked at def, once either is
+         * rebound run this level as written. The levels before it had
+         * already resolved join, so their pieces are still joined here */
+        if (builtins_shadowed
+            && (lbuiltin_named("if")->shadows || lbuiltin_named("join")->shadows)) {
+            r = lval_eval_copy(frame, body);
+            break;
+        }
+
+        lval* c = lval_eval(frame, lval_own(lval_copy(body->cell[1])));
+        if (c->type != LVAL_BOOL) {
+            /* let if report the bad condition */
+            r = c->type == LVAL_ERR ? c
+                : builtin_if(frame, lval_add(lval_add(lval_add(lval_sexpr(), c),
+                                                      lval_qexpr()), lval_qexpr()));
+            break;
+        }
+        int branch = c->num ? 2 : 3;
+        lval_del(c);
+        if (branch != fn->trmc) {
+            r = lval_eval_copy(frame, body->cell[branch]);
+            break;
+        }
+
+        lval* x = lval_eval(frame, lval_own(lval_copy(step->cell[1])));
+        if (x->type == LVAL_ERR) {
+            r = x;
+            break;
+        }
+        pieces = lval_add(pieces, x);
+
+        /* self may have been rebound since def, then call it as is */
+        lval* g = lenv_get(frame, fn->self);
+        int same = g->type == LVAL_FUN && g->fun == fn && g->count == 0 && !g->memo;
+        lval_del(g);
+        if (!same) {
+            r = lval_eval(frame, lval_own(lval_copy(call)));
+            break;
+        }
+
+        lval* args = lval_sexpr();
+        for (int i = 1; i < call->count; i++) {
+            lval* y = lval_eval(frame, lval_own(lval_copy(call->cell[i])));
+            args = lval_add(args, y);
+            if (y->type == LVAL_ERR) {
+                break;
+            }
+        }
+        if (args->cell[args->count - 1]->type == LVAL_ERR) {
+            r = lval_pop(args, args->count - 1);
+            lval_del(args);
+            break;
+        }
+        for (int i = 0; i < formals->count; i++) {
+            lenv_set(frame, idx[i], args->cell[i]);
+        }
+        args->count = 0;
+        lval_del(args);
+    }
+    free(idx);
+
+    if (r->type == LVAL_ERR || pieces->count == 0) {
+        lval_del(pieces);
+        return r;
+    }
+
+    /* the innermost join fails first, as it would when nested */
+    for (int i = pieces->count - 1; i >= 0; i--) {
+        int last = i == pieces->count - 1;
+        if (pieces->cell[i]->type != LVAL_QEXPR || (last && r->type != LVAL_QEXPR)) {
+            lval* a = lval_add(lval_sexpr(), lval_pop(pieces, i));
+            if (last) {
+                a = lval_add(a, r);
+            } else {
+                a = lval_add(a, lval_qexpr());
+                lval_del(r);
+            }
+            lval_del(pieces);
+            return builtin_join(frame, a);
+        }
+    }
+
+    long total = r->count;
+    for (int i = 0; i < pieces->count; i++) {
+        total += pieces->cell[i]->count;
+    }
+    lval* x = lval_qexpr();
+    x->cell = malloc(sizeof(lval*) * (total ? total : 1));
+    for (int i = 0; i <= pieces->count; i++) {
+        lval* y = i < pieces->count ? pieces->cell[i] : r;
+        if (y->count) {
+            memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count);
+            x->count += y->count;
+            y->count = 0;
+        }
+    }
+    lval_del(r);
+    lval_del(pieces);
+    return x;
+}
+
+void lnum_del(lnum* n) {
+    if (--n->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < n->count; i++) {
+        lnum_del(n->kids[i]);
+    }
+    free(n->kids);
+    free(n);
+}
+
+/* an operand that must be a number: a literal, a symbol, a nested op
+ * or annotation, or anything else evaluated as an lval. NULL when it
+ * can't be a number, so the enclosing op is left to the builtin */
+lnum* lnum_leaf(lenv* e, lval* x) {
+    lnum* n;
+    switch (x->type) {
+        case LVAL_NUM:
+        case LVAL_SYM:
+            n = calloc(1, sizeof(lnum));
+            n->refs = 1;
+            n->op = x->type == LVAL_NUM ? LNUM_CONST : LNUM_SYM;
+            return n;
+        case LVAL_SEXPR:
+            n = lnum_op(e, x);
+            if (n && n->op >= LNUM_LT) {
+                lnum_del(n);
+                return NULL;
+            }
+            if (n == NULL) {
+                n = calloc(1, sizeof(lnum));
+                n->refs = 1;
+                n->op = LNUM_EXPR;
+            }
+            return n;
+        default:
+            return NULL;
+    }
+}
+
+/* compiles v when it's a call of an arithmetic or comparison builtin,
+ * or a (: x Number) annotation, with a fixed number of operands */
+lnum* lnum_op(lenv* e, lval* v) {
+    static struct {
+        char* name;
+        lbuiltin fn;
+        int op;
+        int min;
+        int max;
+    } ops[] = {
+        { "+",  builtin_add, LNUM_ADD, 2, LNUM_MAX_ARGS },
+        { "-",  builtin_sub, LNUM_SUB, 1, LNUM_MAX_ARGS },
+        { "*",  builtin_mul, LNUM_MUL, 2, LNUM_MAX_ARGS },
+        { "/",  builtin_div, LNUM_DIV, 2, LNUM_MAX_ARGS },
+        { "<",  builtin_lt,  LNUM_LT,  2, 2 },
+        { ">",  builtin_gt,  LNUM_GT,  2, 2 },
+        { "<=", builtin_le,  LNUM_LE,  2, 2 },
+        { ">=", builtin_ge,  LNUM_GE,  2, 2 },
+        { ":",  builtin_the, LNUM_THE, 2, 2 },
+    };
+
+    lbuiltin fn = v->count >= 2 ? lval_head_builtin(e, v) : NULL;
+    if (fn == NULL || lbuiltin_shadowed(v->cell[0])) {
+        return NULL;
+    }
+
+    int k = -1;
+    int nops = sizeof(ops) / sizeof(ops[0]);
+    for (int i = 0; i < nops; i++) {
+        if (ops[i].fn == fn) {
+            k = i;
+            break;
+        }
+    }
+    if (k < 0 || v->count - 1 < ops[k].min || v->count - 1 > ops[k].max) {
+        return NULL;
+    }
+    /* only the annotated operand of ':' is compiled, the type must be
+     * spelt Number */
+    int count = v->count - 1;
+    if (ops[k].op == LNUM_THE) {
+        if (v->cell[2]->type != LVAL_SYM || strcmp(v->cell[2]->sym, "Number") != 0) {
+            return NULL;
+        }
+        count = 1;
+    }
+
+    lnum* n = calloc(1, sizeof(lnum));
+    n->refs = 1;
+    n->op = ops[k].op;
+    n->name = ops[k].name;
+    n->kids = malloc(sizeof(lnum*) * count);
+    n->readonly = 1;
+    for (int i = 0; i < count; i++) {
+        lnum* kid = lnum_leaf(e, v->cell[i + 1]);
+        if (kid == NULL) {
+            lnum_del(n);
+            return NULL;
+        }
+        n->kids[n->count++] = kid;
+        if (kid->op == LNUM_EXPR || (kid->op >= LNUM_THE && !kid->readonly)) {
+            n->readonly = 0;
+        }
+    }
+    return n;
+}
+
+/* compiles every arithmetic S-Expression in a lambda body, nested ones
+ * included as they may also be reached through an evaluated leaf */
+void lnum_attach(lenv* e, lval* v) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+        return;
+    }
+    if (v->type == LVAL_SEXPR && v->native == NULL) {
+        v->native = lnum_op(e, v);
+    }
+    for (int i = 0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        if (x->native == NULL && lval_is_branch(e, v, i)) {
+            x->native = lnum_op(e, x);
+        }
+        lnum_attach(e, x);
+    }
+}
+
+/* evaluates n over the cells of v into r, returning the error the
+ * builtins would have given, if any. Operands are all evaluated before
+ * any is type checked, just as lval_eval_sexpr would */
+lval* lnum_eval(lenv* e, lnum* n, lval* v, long* r) {
+    long xs[LNUM_MAX_ARGS];
+    int bad = -1;
+    int bad_type = 0;
+
+    for (int i = 0; i < n->count; i++) {
+        lnum* k = n->kids[i];
+        lval* x = v->cell[i + 1];
+        lval* y;
+        switch (k->op) {
+            case LNUM_CONST:
+                xs[i] = x->num;
+                break;
+            case LNUM_SYM:
+                y = lenv_find(e, x);
+                if (y == NULL) {
+                    return lval_err_code(LERR_UNBOUND, x->sym, 0, 0, 0);
+                }
+                if (y->type == LVAL_NUM) {
+                    xs[i] = y->num;
+                } else if (bad < 0) {
+                    bad = i;
+                    bad_type = y->type;
+                }
+                break;
+            case LNUM_EXPR:
+                y = lval_eval(e, x);
+                v->cell[i + 1] = y;
+                if (y->type == LVAL_ERR) {
+                    v->cell[i + 1] = lval_sexpr();
+                    return y;
+                }
+                if (y->type == LVAL_NUM) {
+                    xs[i] = y->num;
+                } else if (bad < 0) {
+                    bad = i;
+                    bad_type = y->type;
+                }
+                break;
+            default:
+                y = lnum_eval(e, k, x, &xs[i]);
+                if (y) {
+                    return y;
+                }
+                break;
+        }
+    }
+
+    if (bad >= 0) {
+        if (n->op == LNUM_THE) {
+            return lval_err("':' expected %s, got %s", ltype_name(LVAL_NUM), ltype_name(bad_type));
+        }
+        return lval_err_code(LERR_TYPE, n->name, bad, LVAL_NUM, bad_type);
+    }
+
+    switch (n->op) {
+        case LNUM_THE:
+            *r = xs[0];
+            break;
+        case LNUM_ADD:
+            *r = xs[0];
+            for (int i = 1; i < n->count; i++) { *r += xs[i]; }
+            break;
+        case LNUM_SUB:
+            *r = n->count == 1 ? -xs[0] : xs[0];
+            for (int i = 1; i < n->count; i++) { *r -= xs[i]; }
+            break;
+        case LNUM_MUL:
+            *r = xs[0];
+            for (int i = 1; i < n->count; i++) { *r *= xs[i]; }
+            break;
+        case LNUM_DIV:
+            for (int i = 1; i < n->count; i++) {
+                if (xs[i] == 0) {
+                    return lval_err_code(LERR_DIV_ZERO, "/", 0, 0, 0);
+                }
+            }
+            *r = xs[0];
+            for (int i = 1; i < n->count; i++) { *r /= xs[i]; }
+            break;
+        /* compared as ints, like the builtins */
+        case LNUM_LT: *r = (int)xs[0] <  (int)xs[1]; break;
+        case LNUM_GT: *r = (int)xs[0] >  (int)xs[1]; break;
+        case LNUM_LE: *r = (int)xs[0] <= (int)xs[1]; break;
+        case LNUM_GE: *r = (int)xs[0] >= (int)xs[1]; break;
+    }
+    return NULL;
+}
+
+/* the value of v's native tree, v is only left as it was when the tree
+ * is readonly */
+lval* lnum_value(lenv* e, lval* v) {
+    long r;
+    lval* err = lnum_eval(e, v->native, v, &r);
+    if (err) {
+        return err;
+    }
+    return v->native->op >= LNUM_LT ? lval_bool(r) : lval_num(r);
+}
+
+/* whether the builtins n was compiled from still have their names */
+int lnum_holds(lnum* n) {
+    if (n->op < LNUM_THE) {
+        return 1;
+    }
+    if (lbuiltin_named(n->name)->shadows) {
+        return 0;
+    }
+    for (int i = 0; i < n->count; i++) {
+        if (!lnum_holds(n->kids[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+lval* lnum_run(lenv* e, lval* v) {
+    lval* x = lnum_value(e, v);
+    lval_del(v);
+    return x;
+}
+
+int lval_eq(lval* x, lval* y) {
+    if (x == y) {
+        return 1;
+    }
+    if (x->type != y->type) {
+        return 0;
+    }
+    /* two cached hashes that differ can't be equal */
+    if (x->hash && y->hash && x->hash != y->hash) {
+        return 0;
+    }
+
+    switch (x->type) {
+        case LVAL_ERR:
+            return (strcmp(lval_err_msg(x), lval_err_msg(y)) == 0);
+        case LVAL_NUM:
+        case LVAL_BOOL:
+            return (x->num == y->num);
+        case LVAL_SYM:
+            return (strcmp(x->sym, y->sym) == 0);
+        case LVAL_STR:
+            return (strcmp(x->str, y->str) == 0);
+        case LVAL_FUN:
+            if (x->memo || y->memo) {
+                return x->memo == y->memo;
+            } else if (x->builtin) {
+                return x->builtin == y->builtin;
+            }
+            if (x->count != y->count || x->macro != y->macro) {
+                return 0;
+            }
+            if (x->fun != y->fun &&
+                !(lval_eq(x->fun->formals, y->fun->formals) &&
+                  lval_eq(x->fun->body, y->fun->body))) {
+                return 0;
+            }
+            for (int i = 0; i < x->count; i++) {
+                if (!lval_eq(x->cell[i], y->cell[i])) {
+                    return 0;
+                }
+            }
+            return 1;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        case LVAL_RECUR:
+            if (x->count != y->count) {
+                return 0;
+            }
+            for (int i = 0; i < x->count; i++) {
+                if (!lval_eq(x->cell[i], y->cell[i])) {
+                    return 0;
+                }
+            }
+            return 1;
+        case LVAL_SEQ:
+            return x == y;
+        case LVAL_MAP:
+            if (x->map->root == y->map->root) {
+                return 1;
+            }
+            if (x->map->count != y->map->count) {
+                return 0;
+            } else {
+                lmap_node** xs = lmap_leaves(x->map->root, x->map->count);
+                int r = 1;
+                for (long i = 0; r && i < x->map->count; i++) {
+                    lmap_node* n = lmap_find(y->map, xs[i]->key, xs[i]->hash);
+                    r = n && lval_eq(xs[i]->val, n->val);
+                }
+                free(xs);
+                return r;
+            }
+        case LVAL_ARR:
+            return x->arr == y->arr ||
+                (x->arr->count == y->arr->count &&
+                 memcmp(x->arr->data, y->arr->data, sizeof(long) * x->arr->count) == 0);
+        case LVAL_VEC: {
+            long n = lval_vec_len(x);
+            if (n != lval_vec_len(y)) {
+                return 0;
+            }
+            for (long i = 0; i < n; i++) {
+                if (!lval_eq(x->vec->items[x->vec_off + i], y->vec->items[y->vec_off + i])) {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* whether v's hash stays right for as long as v lives, false for the
+ * values that change in place and anything holding one */
+int lval_hash_keeps(lval* v) {
+    switch (v->type) {
+        case LVAL_MAP:
+        case LVAL_VEC:
+            return 0;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        case LVAL_RECUR:
+            return v->hash != 0;
+        case LVAL_FUN:
+            return v->count == 0;
+        default:
+            return 1;
+    }
+}
+
+/* structural hash, equal values (by lval_eq) always hash the same */
+unsigned long lval_hash(lval* v) {
+    unsigned long h;
+
+    switch (v->type) {
+        case LVAL_NUM:
+        case LVAL_BOOL:
+            /* splitmix64 finaliser */
+            h = (unsigned long)v->num + 0x9e3779b97f4a7c15UL * (v->type + 1);
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9UL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebUL;
+            return h ^ (h >> 31);
+        case LVAL_ERR:
+        case LVAL_SYM:
+        case LVAL_STR:
+            if (v->hash) {
+                return v->hash;
+            }
+            /* FNV-1a */
+            h = 0xcbf29ce484222325UL ^ v->type;
+            for (char* c = v->type == LVAL_ERR ? lval_err_msg(v) :
+                           v->type == LVAL_SYM ? v->sym : v->str; *c; c++) {
+                h = (h ^ (unsigned char)*c) * 0x100000001b3UL;
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        case LVAL_RECUR:
+            if (v->hash) {
+                return v->hash;
+            }
+            h = 0x84222325cbf29ce4UL ^ v->type;
+            int keep = 1;
+            for (int i = 0; i < v->count; i++) {
+                lval* c = v->cell[i];
+                h = (h ^ lval_hash(c)) * 0x100000001b3UL;
+                h ^= h >> 29;
+                keep = keep && lval_hash_keeps(c);
+            }
+            /* a map or vector inside may change in place, so the hash is
+             * only good for now and isn't cached (lval_eq relies on it) */
+            if (!keep) {
+                return h ? h : 1;
+            }
+            break;
+        case LVAL_FUN:
+            if (v->memo) {
+                return (unsigned long)v->memo * 0x9e3779b97f4a7c15UL;
+            }
+            if (v->builtin) {
+                return (unsigned long)v->builtin * 0x9e3779b97f4a7c15UL;
+            }
+            h = lval_hash(v->fun->formals) * 31 + lval_hash(v->fun->body);
+            for (int i = 0; i < v->count; i++) {
+                h = (h ^ lval_hash(v->cell[i])) * 0x100000001b3UL;
+            }
+            return h;
+        case LVAL_MAP:
+            /* order independent, as equal maps may differ in layout */
+            h = v->map->count;
+            {
+                lmap_node** xs = lmap_leaves(v->map->root, v->map->count);
+                for (long i = 0; i < v->map->count; i++) {
+                    h += xs[i]->hash ^ (lval_hash(xs[i]->val) * 31);
+                }
+                free(xs);
+            }
+            return h;
+        case LVAL_ARR:
+            h = 0x9ce484222325cbf2UL;
+            for (long i = 0; i < v->arr->count; i++) {
+                h = (h ^ (unsigned long)v->arr->data[i]) * 0x100000001b3UL;
+            }
+            return h;
+        case LVAL_VEC:
+            h = 0x2325cbf29ce48422UL;
+            for (long i = 0; i < lval_vec_len(v); i++) {
+                h = (h ^ lval_hash(v->vec->items[v->vec_off + i])) * 0x100000001b3UL;
+                h ^= h >> 29;
+            }
+            return h;
+        default:
+            return (unsigned long)v;
+    }
+
+    /* 0 means not yet computed */
+    v->hash = h ? h : 1;
+    return v->hash;
+}
+
+/* total order used by sort: by type first, then by value */
+/* orders errors on the fields they were made from. lval_err_msg would
+ * write the message it formats into them, and sort compares on several
+ * threads at once */
+int lval_err_cmp(lval* x, lval* y) {
+    if (x->err_code != y->err_code) {
+        return x->err_code < y->err_code ? -1 : 1;
+    }
+    switch (x->err_code) {
+        case LERR_MSG:
+        case LERR_USER:
+            return strcmp(x->err, y->err);
+        case LERR_UNBOUND:
+            return strcmp(x->sym, y->sym);
+    }
+
+    int c = strcmp(x->err_func ? x->err_func : "", y->err_func ? y->err_func : "");
+    for (int i = 0; c == 0 && i < 3; i++) {
+        c = (x->err_arg[i] > y->err_arg[i]) - (x->err_arg[i] < y->err_arg[i]);
+    }
+    return c;
+}
+
+int lval_cmp(lval* x, lval* y) {
+    if (x->type != y->type) {
+        return x->type < y->type ? -1 : 1;
+    }
+
+    switch (x->type) {
+        case LVAL_NUM:
+        case LVAL_BOOL:
+            return (x->num > y->num) - (x->num < y->num);
+        case LVAL_ERR:
+            return lval_err_cmp(x, y);
+        case LVAL_SYM:
+            return strcmp(x->sym, y->sym);
+        case LVAL_STR:
+            return strcmp(x->str, y->str);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        case LVAL_RECUR:
+            for (int i = 0; i < x->count && i < y->count; i++) {
+                int c = lval_cmp(x->cell[i], y->cell[i]);
+                if (c != 0) {
+                    return c;
+                }
+            }
+            return (x->count > y->count) - (x->count < y->count);
+        case LVAL_ARR:
+            for (long i = 0; i < x->arr->count && i < y->arr->count; i++) {
+                if (x->arr->data[i] != y->arr->data[i]) {
+                    return x->arr->data[i] < y->arr->data[i] ? -1 : 1;
+                }
+            }
+            return (x->arr->count > y->arr->count) - (x->arr->count < y->arr->count);
+        case LVAL_VEC: {
+            long nx = lval_vec_len(x);
+            long ny = lval_vec_len(y);
+            for (long i = 0; i < nx && i < ny; i++) {
+                int c = lval_cmp(x->vec->items[x->vec_off + i], y->vec->items[y->vec_off + i]);
+                if (c != 0) {
+                    return c;
+                }
+            }
+            return (nx > ny) - (nx < ny);
+        }
+    }
+
+    return 0;
+}
+
+char* ltype_name(int t) {
+    switch(t) {
+        case LVAL_ERR:
+            return "Error";
+            break;
+        case LVAL_NUM:
+            return "Number";
+            break;
+        case LVAL_BOOL:
+            return "Bool";
+            break;
+        case LVAL_SYM:
+            return "Symbol";
+            break;
+        case LVAL_STR:
+            return "String";
+            break;
+        case LVAL_FUN:
+            return "Function";
+            break;
+        case LVAL_SEXPR:
+            return "S-Expression";
+            break;
+        case LVAL_QEXPR:
+            return "Q-Expression";
+            break;
+        case LVAL_RECUR:
+            return "Recur";
+            break;
+        case LVAL_SEQ:
+            return "Sequence";
+            break;
+        case LVAL_MAP:
+            return "Map";
+            break;
+        case LVAL_ARR:
+            return "Array";
+            break;
+        case LVAL_VEC:
+            return "Vector";
+            break;
+        default:
+            return "Unknown";
+    }
+}
+
+/* builtins */
+
+lval* builtin_list(lenv* e, lval* a) {
+    a->type = LVAL_QEXPR;
+    a->hash = 0;
+    return a;
+}
+
+lval* builtin_head(lenv* e, lval* a) {
+    LASSERT_NUM("head", a, 1);
+    if (a->cell[0]->type == LVAL_SEQ) {
+        return lseq_head(e, a);
+    }
+    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+
+    return builtin_head_fast(e, a);
+}
+
+lval* builtin_head_fast(lenv* e, lval* a) {
+    LASSERT(a, (a->cell[0]->count != 0),
+            "'head' passed {}");
+
+    lval* v = lval_take(a, 0);
+    while(v->count > 1) {
+        lval_del(lval_pop(v, 1));
+    }
+    return v;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+    LASSERT_NUM("tail", a, 1);
+    if (a->cell[0]->type == LVAL_SEQ) {
+        return lseq_tail(e, a);
+    }
+    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+
+    return builtin_tail_fast(e, a);
+}
+
+lval* builtin_tail_fast(lenv* e, lval* a) {
+    LASSERT(a, (a->cell[0]->count != 0),
+            "'tail' passed {}");
+
+    lval* v = lval_take(a, 0);
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+lval* builtin_init(lenv* e, lval* a) {
+    LASSERT_NUM("init", a, 1);
+    LFORCE(e, a, 0);
+    LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->count != 0),
+            "'init' passed {}");
+
+    lval* v = lval_take(a, 0);
+    lval_del(lval_pop(v, v->count - 1));
+    return v;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+    LASSERT_NUM("eval", a, 1);
+    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+    return builtin_eval_fast(e, a);
+}
+
+lval* builtin_eval_fast(lenv* e, lval* a) {
+    lval* x = lval_take(a, 0);
+    x->type = LVAL_SEXPR;
+    x->hash = 0;
+    leval_prepare(e, x);
+    return lval_eval(e, x);
+}
+
+/* a hash of v that only looks at types, symbols and list lengths, so
+ * code that differs only in the data it carries has the same shape.
+ * budget bounds the nodes visited, 0 is returned once it runs out */
+unsigned long lval_shape(lval* v, int* budget) {
+    if (--*budget < 0) {
+        return 0;
+    }
+    /* analysis only looks into builtins, so other functions are alike */
+    if (v->type == LVAL_SYM || (v->type == LVAL_FUN && v->builtin)) {
+        return lval_hash(v);
+    }
+    unsigned long h = 0x9e3779b97f4a7c15UL * (v->type + 1);
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+        h ^= v->count;
+        for (int i = 0; i < v->count; i++) {
+            h = (h ^ lval_shape(v->cell[i], budget)) * 0x100000001b3UL;
+            h ^= h >> 29;
+        }
+    }
+    return h;
+}
+
+/* whether anything in v was compiled or proven */
+int lval_marked(lval* v) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+        return 0;
+    }
+    if (v->native || (v->site && v->site->fast)) {
+        return 1;
+    }
+    for (int i = 0; i < v->count; i++) {
+        if (lval_marked(v->cell[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* copies the analysis of from onto to, returning whether they have the
+ * same shape. Nodes are only grafted onto once everything below them
+ * has matched, so a mismatch never leaves a wrong analysis behind */
+int lval_graft(lval* to, lval* from) {
+    if (to->type != from->type) {
+        return 0;
+    }
+    if (to->type == LVAL_SYM) {
+        return strcmp(to->sym, from->sym) == 0;
+    }
+    if (to->type == LVAL_FUN) {
+        return to->builtin == from->builtin;
+    }
+    if (to->type != LVAL_SEXPR && to->type != LVAL_QEXPR) {
+        return 1;
+    }
+    if (to->count != from->count) {
+        return 0;
+    }
+    for (int i = 0; i < to->count; i++) {
+        if (!lval_graft(to->cell[i], from->cell[i])) {
+            return 0;
+        }
+    }
+
+    if (from->native && to->native == NULL) {
+        to->native = from->native;
+        to->native->refs++;
+    }
+    if (to->site == NULL) {
+        to->site = from->site;
+    }
+    return 1;
+}
+
+/* analyses code about to be evaluated by eval as a lambda body would
+ * be, or reuses the analysis of earlier code of the same shape. Pure
+ * calls aren't folded as the cached form is shared by other data */
+void leval_prepare(lenv* e, lval* x) {
+    if (builtins_shadowed) {
+        return;
+    }
+    int budget = EVAL_CACHE_NODES;
+    unsigned long h = lval_shape(x, &budget);
+    if (budget < 0) {
+        return;
+    }
+
+    leval_slot* s = &eval_cache.slots[h & (EVAL_CACHE_SIZE - 1)];
+    /* with nothing to graft a colliding shape only loses an analysis */
+    if (s->form && s->shape == h && (!s->marked || lval_graft(x, s->form))) {
+        eval_cache.hits++;
+        return;
+    }
+
+    eval_cache.misses++;
+    lbuiltin_mark(e, x, 0);
+    lnum_attach(e, x);
+    if (s->form) {
+        lval_del(s->form);
+    }
+    s->shape = h;
+    s->form = lval_copy(x);
+    s->marked = lval_marked(x);
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("join", a, 1);
+    for (int i = 0; i < a->count; i++) {
+        LFORCE(e, a, i);
         LASSERT_TYPE("join", a, i, LVAL_QEXPR);
     }
 
-    lval* x = lval_pop(a, 0);
-    while(a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    /* size the result once, then move every cell across; the emptied
+     * lists go with a */
+    lval* x = lval_pop(a, 0);
+    int total = x->count;
+    for (int i = 0; i < a->count; i++) {
+        total += a->cell[i]->count;
+    }
+    x->cell = realloc(x->cell, sizeof(lval*) * (total ? total : 1));
+    lval_forget(x);
+
+    for (int i = 0; i < a->count; i++) {
+        lval* y = a->cell[i];
+        if (y->count) {
+            memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count);
+            x->count += y->count;
+            y->count = 0;
+        }
+    }
+
+    lval_del(a);
+    return x;
+}
+
+/* type checks and reductions over a->cell are kept as plain loops over
+ * contiguous cells, the arguments are freed once at the end */
+
+lval* builtin_add(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("+", a, 2);
+
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("+", a, i, LVAL_NUM);
+    }
+
+    long r = a->cell[0]->num;
+    for (int i = 1; i < a->count; i++) {
+        r += a->cell[i]->num;
+    }
+
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("-", a, 1);
+
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("-", a, i, LVAL_NUM);
+    }
+
+    long r = a->cell[0]->num;
+    if (a->count == 1) {
+        r = -r;
+    }
+    for (int i = 1; i < a->count; i++) {
+        r -= a->cell[i]->num;
+    }
+
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("*", a, 2);
+
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("*", a, i, LVAL_NUM);
+    }
+
+    long r = a->cell[0]->num;
+    for (int i = 1; i < a->count; i++) {
+        r *= a->cell[i]->num;
+    }
+
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("/", a, 2);
+
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("/", a, i, LVAL_NUM);
+    }
+    for (int i = 1; i < a->count; i++) {
+        if (a->cell[i]->num == 0) {
+            lval_del(a);
+            return lval_err_code(LERR_DIV_ZERO, "/", 0, 0, 0);
+        }
+    }
+
+    long r = a->cell[0]->num;
+    for (int i = 1; i < a->count; i++) {
+        r /= a->cell[i]->num;
+    }
+
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_bool(lenv* e, lval* a) {
+    LASSERT_NUM("bool", a, 1);
+    LASSERT_TYPE("bool", a, 0, LVAL_NUM);
+
+    lval* x = lval_bool(a->cell[0]->num);
+    lval_del(a);
+    return x;
+}
+
+/* (: x type) is x, or an error if x isn't of the named type. Numbers
+ * checked this way compile into native arithmetic, see lnum_op */
+lval* builtin_the(lenv* e, lval* a) {
+    LASSERT_NUM(":", a, 2);
+    LASSERT_TYPE(":", a, 1, LVAL_STR);
+    LASSERT(a, (strcmp(ltype_name(a->cell[0]->type), a->cell[1]->str) == 0),
+            "':' expected %s, got %s", a->cell[1]->str, ltype_name(a->cell[0]->type));
+
+    return lval_take(a, 0);
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+    LASSERT_NUM("<", a, 2);
+    LASSERT_TYPE("<", a, 0, LVAL_NUM);
+    LASSERT_TYPE("<", a, 1, LVAL_NUM);
+
+    int x = a->cell[0]->num;
+    int y = a->cell[1]->num;
+    lval_del(a);
+    return lval_bool(x < y);
+}
+
+lval* builtin_gt(lenv* e, lval* a) {
+    LASSERT_NUM(">", a, 2);
+    LASSERT_TYPE(">", a, 0, LVAL_NUM);
+    LASSERT_TYPE(">", a, 1, LVAL_NUM);
+
+    int x = a->cell[0]->num;
+    int y = a->cell[1]->num;
+    lval_del(a);
+    return lval_bool(x > y);
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+    LASSERT_NUM("<=", a, 2);
+    LASSERT_TYPE("<=", a, 0, LVAL_NUM);
+    LASSERT_TYPE("<=", a, 1, LVAL_NUM);
+
+    int x = a->cell[0]->num;
+    int y = a->cell[1]->num;
+    lval_del(a);
+    return lval_bool(x <= y);
+}
+
+lval* builtin_ge(lenv* e, lval* a) {
+    LASSERT_NUM(">=", a, 2);
+    LASSERT_TYPE(">=", a, 0, LVAL_NUM);
+    LASSERT_TYPE(">=", a, 1, LVAL_NUM);
+
+    int x = a->cell[0]->num;
+    int y = a->cell[1]->num;
+    lval_del(a);
+    return lval_bool(x >= y);
+}
+
+lval* builtin_eq(lenv* e, lval* a) {
+    LASSERT_NUM("==", a, 2);
+
+    return builtin_eq_fast(e, a);
+}
+
+lval* builtin_eq_fast(lenv* e, lval* a) {
+    if (a->cell[0]->type == LVAL_SEQ || a->cell[1]->type == LVAL_SEQ) {
+        return lseq_eq(e, a, 1);
+    }
+    int r = lval_eq(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return lval_bool(r);
+}
+
+lval* builtin_ne(lenv* e, lval* a) {
+    LASSERT_NUM("!=", a, 2);
+
+    return builtin_ne_fast(e, a);
+}
+
+lval* builtin_ne_fast(lenv* e, lval* a) {
+    if (a->cell[0]->type == LVAL_SEQ || a->cell[1]->type == LVAL_SEQ) {
+        return lseq_eq(e, a, 0);
+    }
+    int r = !lval_eq(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return lval_bool(r);
+}
+
+lval* builtin_and(lenv* e, lval* a) {
+    LASSERT_NUM("&&", a, 2);
+    LASSERT_TYPE("&&", a, 0, LVAL_BOOL);
+    LASSERT_TYPE("&&", a, 1, LVAL_BOOL);
+
+    return builtin_and_fast(e, a);
+}
+
+lval* builtin_and_fast(lenv* e, lval* a) {
+    int r = (a->cell[0]->num == 1 && a->cell[1]->num == 1);
+    lval_del(a);
+    return lval_bool(r);
+}
+
+lval* builtin_or(lenv* e, lval* a) {
+    LASSERT_NUM("||", a, 2);
+    LASSERT_TYPE("||", a, 0, LVAL_BOOL);
+    LASSERT_TYPE("||", a, 1, LVAL_BOOL);
+
+    return builtin_or_fast(e, a);
+}
+
+lval* builtin_or_fast(lenv* e, lval* a) {
+    int r = (a->cell[0]->num == 1 || a->cell[1]->num == 1);
+    lval_del(a);
+    return lval_bool(r);
+}
+
+lval* builtin_not(lenv* e, lval* a) {
+    LASSERT_NUM("!", a, 1);
+    LASSERT_TYPE("!", a, 0, LVAL_BOOL);
+
+    return builtin_not_fast(e, a);
+}
+
+lval* builtin_not_fast(lenv* e, lval* a) {
+    int r;
+    if (a->cell[0]->num == 1) {
+        r = 0;
+    } else {
+        r = 1;
+    }
+    lval_del(a);
+    return lval_bool(r);
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+    LASSERT_NUM("if", a, 3);
+    LASSERT_TYPE("if", a, 0, LVAL_BOOL);
+    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+
+    return builtin_if_fast(e, a);
+}
+
+lval* builtin_if_fast(lenv* e, lval* a) {
+    lval* x;
+    a->cell[1]->type = LVAL_SEXPR;
+    a->cell[2]->type = LVAL_SEXPR;
+    a->cell[1]->hash = 0;
+    a->cell[2]->hash = 0;
+
+    if (a->cell[0]->num) {
+        x = lval_eval(e, lval_pop(a, 1));
+    } else {
+        x = lval_eval(e, lval_pop(a, 2));
+    }
+
+    lval_del(a);
+    return x;
+}
+
+/* (select {cond value} ...), the value of the first true cond */
+lval* builtin_select(lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("select", a, i, LVAL_QEXPR);
+        LASSERT(a, (a->cell[i]->count == 2),
+                "'select' clause %d must be {condition value}", i);
+    }
+
+    for (int i = 0; i < a->count; i++) {
+        lval* c = lval_item(e, a->cell[i], 0);
+        if (c->type == LVAL_ERR) {
+            lval_del(a);
+            return c;
+        }
+        if (c->type != LVAL_BOOL) {
+            lval* err = lval_err("'select' condition must be %s, got %s",
+                                 ltype_name(LVAL_BOOL), ltype_name(c->type));
+            lval_del(c);
+            lval_del(a);
+            return err;
+        }
+        int hit = c->num;
+        lval_del(c);
+
+        if (hit) {
+            lval* x = lval_item(e, a->cell[i], 1);
+            lval_del(a);
+            return x;
+        }
+    }
+
+    lval_del(a);
+    return lval_err("No selection found");
+}
+
+/* whether the clauses[1..n] all have literal keys */
+int lcase_literal(lval** clauses, int n) {
+    for (int i = 1; i <= n; i++) {
+        if (clauses[i]->type != LVAL_QEXPR || clauses[i]->count != 2) {
+            return 0;
+        }
+        int t = clauses[i]->cell[0]->type;
+        if (t != LVAL_NUM && t != LVAL_STR && t != LVAL_QEXPR) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* the table for clauses[1..n], which must be literal */
+lcase* lcase_new(lval** clauses, int n) {
+    lcase* c = calloc(1, sizeof(lcase));
+    c->refs = 1;
+    c->cap = 8;
+    while (c->cap < 2 * n) {
+        c->cap *= 2;
+    }
+    c->keys = calloc(c->cap, sizeof(unsigned long));
+    c->idx = calloc(c->cap, sizeof(int));
+
+    /* the first clause for a key wins, as it would in a linear scan */
+    for (int i = 1; i <= n; i++) {
+        lval* k = clauses[i]->cell[0];
+        unsigned long kh = lval_hash(k);
+        long j = kh & (c->cap - 1);
+        while (c->idx[j] && !(c->keys[j] == kh &&
+                              lval_eq(clauses[c->idx[j]]->cell[0], k))) {
+            j = (j + 1) & (c->cap - 1);
+        }
+        if (c->idx[j] == 0) {
+            c->keys[j] = kh;
+            c->idx[j] = i;
+        }
+    }
+    return c;
+}
+
+void lcase_del(lcase* c) {
+    if (--c->refs > 0) {
+        return;
+    }
+    free(c->keys);
+    free(c->idx);
+    free(c);
+}
+
+/* the number of the clause whose key equals x, or -1 */
+int lcase_find(lcase* c, lval** clauses, lval* x) {
+    unsigned long h = lval_hash(x);
+    for (long j = h & (c->cap - 1); c->idx[j]; j = (j + 1) & (c->cap - 1)) {
+        if (c->keys[j] == h && lval_eq(clauses[c->idx[j]]->cell[0], x)) {
+            return c->idx[j];
+        }
+    }
+    return -1;
+}
+
+/* (case x {key value} ...), the value of the first key equal to x. In a
+ * lambda body a call with literal keys is run by lfuse_case off a table
+ * built when the body was analysed, elsewhere the keys are tried in turn */
+lval* builtin_case(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("case", a, 1);
+    for (int i = 1; i < a->count; i++) {
+        LASSERT_TYPE("case", a, i, LVAL_QEXPR);
+        LASSERT(a, (a->cell[i]->count == 2),
+                "'case' clause %d must be {key value}", i);
+    }
+
+    int hit = -1;
+    for (int i = 1; i < a->count && hit < 0; i++) {
+        lval* k = lval_item(e, a->cell[i], 0);
+        if (k->type == LVAL_ERR) {
+            lval_del(a);
+            return k;
+        }
+        if (lval_eq(k, a->cell[0])) {
+            hit = i;
+        }
+        lval_del(k);
+    }
+
+    if (hit < 0) {
+        lval_del(a);
+        return lval_err("No case found");
+    }
+
+    lval* x = lval_item(e, a->cell[hit], 1);
+    lval_del(a);
+    return x;
+}
+
+/* appends the ops testing value against pattern p, found at path */
+lval* lmatch_compile(lmatch* m, lval* p, int* path, int depth) {
+    lmatch_op op;
+    op.depth = depth;
+    op.path = malloc(sizeof(int) * (depth ? depth : 1));
+    memcpy(op.path, path, sizeof(int) * depth);
+    op.n = 0;
+    op.x = NULL;
+
+    int rest = -1;
+    switch (p->type) {
+        case LVAL_SYM:
+            if (strcmp(p->sym, "_") == 0) {
+                free(op.path);
+                return NULL;
+            }
+            op.kind = LMATCH_BIND;
+            op.x = lval_copy(p);
+            break;
+        case LVAL_NUM:
+        case LVAL_STR:
+        case LVAL_BOOL:
+            op.kind = LMATCH_EQ;
+            op.x = lval_copy(p);
+            break;
+        case LVAL_QEXPR:
+            for (int i = 0; i < p->count; i++) {
+                if (p->cell[i]->type == LVAL_SYM && strcmp(p->cell[i]->sym, "&") == 0) {
+                    rest = i;
+                    break;
+                }
+            }
+            if (rest >= 0 && (rest != p->count - 2 || p->cell[rest + 1]->type != LVAL_SYM)) {
+                free(op.path);
+                return lval_err("'match' pattern symbol '&' not followed by single symbol");
+            }
+            op.kind = rest >= 0 ? LMATCH_MIN : LMATCH_LEN;
+            op.n = rest >= 0 ? rest : p->count;
+            break;
+        default:
+            free(op.path);
+            return lval_err("'match' invalid pattern of type %s", ltype_name(p->type));
+    }
+
+    m->ops = realloc(m->ops, sizeof(lmatch_op) * (m->nops + 1));
+    m->ops[m->nops++] = op;
+
+    if (p->type == LVAL_QEXPR) {
+        int* sub = malloc(sizeof(int) * (depth + 1));
+        memcpy(sub, path, sizeof(int) * depth);
+        for (int i = 0; i < (rest >= 0 ? rest : p->count); i++) {
+            sub[depth] = i;
+            lval* err = lmatch_compile(m, p->cell[i], sub, depth + 1);
+            if (err) {
+                free(sub);
+                return err;
+            }
+        }
+        if (rest >= 0) {
+            lmatch_op r;
+            r.kind = LMATCH_REST;
+            r.depth = depth;
+            r.path = malloc(sizeof(int) * (depth ? depth : 1));
+            memcpy(r.path, path, sizeof(int) * depth);
+            r.n = rest;
+            r.x = lval_copy(p->cell[rest + 1]);
+            m->ops = realloc(m->ops, sizeof(lmatch_op) * (m->nops + 1));
+            m->ops[m->nops++] = r;
+        }
+        free(sub);
+    }
+    return NULL;
+}
+
+void lmatch_del(lmatch* m) {
+    for (int i = 0; i < m->nops; i++) {
+        free(m->ops[i].path);
+        if (m->ops[i].x) { lval_del(m->ops[i].x); }
+    }
+    if (m->src) { lval_del(m->src); }
+    free(m->ops);
+    free(m->first);
+    free(m);
+}
+
+/* the compiled patterns of the clauses a->cell[1..], built on first
+ * use and cached on the hash of the clause list. A slot is only reused
+ * when its patterns equal the call's, otherwise it's rebuilt */
+lmatch* lmatch_get(lval* a, unsigned long h, lval** err) {
+    lmatch** slot = &match_table.slots[h & (MATCH_CACHE_SIZE - 1)];
+    lmatch* m = *slot;
+    if (m && m->hash == h && m->count == a->count - 1) {
+        int same = 1;
+        for (int i = 1; i < a->count && same; i++) {
+            same = lval_eq(m->src->cell[i - 1], a->cell[i]->cell[0]);
+        }
+        if (same) {
+            return m;
+        }
+    }
+
+    m = calloc(1, sizeof(lmatch));
+    m->hash = h;
+    m->count = a->count - 1;
+    m->first = malloc(sizeof(int) * a->count);
+    int root = 0;
+    for (int i = 1; i < a->count; i++) {
+        m->first[i - 1] = m->nops;
+        *err = lmatch_compile(m, a->cell[i]->cell[0], &root, 0);
+        if (*err) {
+            lmatch_del(m);
+            return NULL;
+        }
+    }
+    m->first[m->count] = m->nops;
+
+    m->src = lval_qexpr();
+    for (int i = 1; i < a->count; i++) {
+        lval_add(m->src, lval_copy(a->cell[i]->cell[0]));
+    }
+
+    if (*slot) {
+        lmatch_del(*slot);
+    }
+    *slot = m;
+    return m;
+}
+
+/* the number of items a list pattern sees in x, a list or a vector,
+ * -1 for anything else */
+long lmatch_len(lval* x) {
+    if (x->type == LVAL_QEXPR) { return x->count; }
+    if (x->type == LVAL_VEC) { return lval_vec_len(x); }
+    return -1;
+}
+
+/* item i of x, which its shape check has shown to be long enough */
+lval* lmatch_item(lval* x, long i) {
+    return x->type == LVAL_VEC ? x->vec->items[x->vec_off + i] : x->cell[i];
+}
+
+/* runs a clause's ops against v, binding into frame as it goes; the
+ * frame is only used when the whole clause matches */
+int lmatch_run(lmatch* m, int clause, lval* v, lenv* frame) {
+    for (int i = m->first[clause]; i < m->first[clause + 1]; i++) {
+        lmatch_op* op = &m->ops[i];
+        lval* x = v;
+        for (int d = 0; d < op->depth; d++) {
+            x = lmatch_item(x, op->path[d]);
+        }
+
+        switch (op->kind) {
+            case LMATCH_LEN:
+                if (lmatch_len(x) != op->n) { return 0; }
+                break;
+            case LMATCH_MIN:
+                if (lmatch_len(x) < op->n) { return 0; }
+                break;
+            case LMATCH_EQ:
+                if (!lval_eq(x, op->x)) { return 0; }
+                break;
+            case LMATCH_BIND:
+                lenv_bind(frame, op->x, lval_copy(x));
+                break;
+            case LMATCH_REST: {
+                /* the rest of a vector is a slice of it */
+                if (x->type == LVAL_VEC) {
+                    x->vec->refs++;
+                    lenv_bind(frame, op->x, lval_vec(x->vec, x->vec_off + op->n,
+                                                     lval_vec_len(x) - op->n));
+                    break;
+                }
+                lval* xs = lval_qexpr();
+                xs->cell = malloc(sizeof(lval*) * (x->count - op->n));
+                for (int j = op->n; j < x->count; j++) {
+                    xs->cell[xs->count++] = lval_copy(x->cell[j]);
+                }
+                lenv_bind(frame, op->x, xs);
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+/* (match v {pattern body} ...) evaluates the body of the first clause
+ * whose pattern fits v, with the pattern's symbols bound. Patterns are
+ * _, a symbol, a number or string literal, or a list of patterns
+ * optionally ending in & rest. A list pattern also fits a vector, whose
+ * rest is then a slice of it */
+lval* builtin_match(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("match", a, 1);
+    LFORCE(e, a, 0);
+    for (int i = 1; i < a->count; i++) {
+        LASSERT_TYPE("match", a, i, LVAL_QEXPR);
+        LASSERT(a, (a->cell[i]->count == 2),
+                "'match' clause %d must be {pattern body}", i);
+    }
+
+    unsigned long h = 0xcbf29ce484222325UL;
+    for (int i = 1; i < a->count; i++) {
+        h = (h ^ lval_hash(a->cell[i])) * 0x100000001b3UL;
+        h ^= h >> 29;
+    }
+    lval* err = NULL;
+    lmatch* m = lmatch_get(a, h, &err);
+    if (m == NULL) {
+        lval_del(a);
+        return err;
+    }
+
+    lenv* frame = lenv_new();
+    frame->parent = e;
+    for (int i = 0; i < m->count; i++) {
+        if (lmatch_run(m, i, a->cell[0], frame)) {
+            lval* body = a->cell[i + 1]->cell[1];
+            lval* x = body->type == LVAL_QEXPR ? lval_eval_copy(frame, body)
+                                              : lval_eval(frame, lval_copy(body));
+            lenv_del(frame);
+            lval_del(a);
+            return x;
+        }
+        /* drop what a partial match bound */
+        for (int j = 0; j < frame->count; j++) {
+            lenv_drop(frame, j);
+        }
+        frame->count = 0;
+    }
+
+    lenv_del(frame);
+    lval_del(a);
+    return lval_err("No match found");
+}
+
+lval* builtin_while(lenv* e, lval* a) {
+    LASSERT_NUM("while", a, 2);
+    LASSERT_TYPE("while", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("while", a, 1, LVAL_QEXPR);
+
+    a->cell[0] = lval_loop_code(e, a->cell[0]);
+    a->cell[1] = lval_loop_code(e, a->cell[1]);
+    while (1) {
+        lval* c = lval_eval_copy(e, a->cell[0]);
+        if (c->type == LVAL_ERR) {
+            lval_del(a);
+            return c;
+        }
+        if (c->type != LVAL_BOOL) {
+            lval* err = lval_err("'while' condition must be %s, got %s",
+                                 ltype_name(LVAL_BOOL), ltype_name(c->type));
+            lval_del(c);
+            lval_del(a);
+            return err;
+        }
+        int run = c->num;
+        lval_del(c);
+        if (!run) {
+            break;
+        }
+
+        lval* x = lval_eval_copy(e, a->cell[1]);
+        if (x->type == LVAL_ERR) {
+            lval_del(a);
+            return x;
+        }
+        lval_del(x);
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+/* counts sym from start up to (but excluding) end, rewriting the
+ * loop variable's binding in e in place on each iteration. It's bound
+ * in e itself so = in the body still reaches e's variables, and is put
+ * back as it was once the loop ends */
+lval* builtin_range_loop(lenv* e, lval* a, long start, long end) {
+    lval* sym = a->cell[0]->cell[0];
+    lval* body = lval_loop_code(e, lval_pop(a, a->count - 1));
+
+    int idx = lenv_index(e, sym);
+    lval* saved = NULL;
+    if (idx >= 0) {
+        saved = lenv_swap(e, idx, lval_num(start));
+    } else {
+        lenv_bind(e, sym, lval_num(start));
+        idx = e->count - 1;
+    }
+
+    /* bindings are only ever appended while it runs, so the slot stays
+     * put */
+    lval* x = lval_sexpr();
+    for (long i = start; i < end; i++) {
+        if (e->vals[idx]->type == LVAL_NUM) {
+            e->vals[idx]->num = i;
+        } else {
+            lenv_set(e, idx, lval_num(i));
+        }
+
+        lval_del(x);
+        x = lval_eval_copy(e, body);
+        if (x->type == LVAL_ERR) {
+            break;
+        }
+    }
+
+    /* a slot appended here is the latest an enclosing loop could have
+     * cached, so removing it moves none of theirs */
+    if (saved) {
+        lenv_set(e, idx, saved);
+    } else {
+        lenv_drop(e, idx);
+        memmove(&e->syms[idx], &e->syms[idx + 1], sizeof(char*) * (e->count - idx - 1));
+        memmove(&e->vals[idx], &e->vals[idx + 1], sizeof(lval*) * (e->count - idx - 1));
+        e->count--;
+    }
+
+    if (x->type != LVAL_ERR) {
+        lval_del(x);
+        x = lval_sexpr();
+    }
+    lval_del(body);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_dotimes(lenv* e, lval* a) {
+    LASSERT_NUM("dotimes", a, 3);
+    LASSERT_TYPE("dotimes", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("dotimes", a, 1, LVAL_NUM);
+    LASSERT_TYPE("dotimes", a, 2, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM),
+            "'dotimes' expects a single loop symbol");
+
+    return builtin_range_loop(e, a, 0, a->cell[1]->num);
+}
+
+lval* builtin_for(lenv* e, lval* a) {
+    LASSERT_NUM("for", a, 4);
+    LASSERT_TYPE("for", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("for", a, 1, LVAL_NUM);
+    LASSERT_TYPE("for", a, 2, LVAL_NUM);
+    LASSERT_TYPE("for", a, 3, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM),
+            "'for' expects a single loop symbol");
+
+    return builtin_range_loop(e, a, a->cell[1]->num, a->cell[2]->num);
+}
+
+lval* builtin_loop(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("loop", a, 2);
+    LASSERT_TYPE("loop", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("loop", a, a->count - 1, LVAL_QEXPR);
+
+    lval* syms = a->cell[0];
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+                "'loop' cannot bind non-symbol (%s)", ltype_name(syms->cell[i]->type));
+    }
+    LASSERT(a, (syms->count == a->count - 2),
+            "'loop' expected %d initial values, got %d", syms->count, a->count - 2);
+
+    /* a single frame for the whole loop, recur rebinds its slots */
+    a->cell[a->count - 1] = lval_loop_code(e, a->cell[a->count - 1]);
+    lenv* f = lenv_new();
+    f->parent = e;
+    int* idx = malloc(sizeof(int) * syms->count);
+    for (int i = 0; i < syms->count; i++) {
+        lenv_put(f, syms->cell[i], a->cell[i + 1]);
+    }
+    for (int i = 0; i < syms->count; i++) {
+        idx[i] = lenv_index(f, syms->cell[i]);
+    }
+
+    lval* x;
+    loop_depth++;
+    while (1) {
+        x = lval_eval_copy(f, a->cell[a->count - 1]);
+        if (x->type != LVAL_RECUR) {
+            break;
+        }
+        if (x->count != syms->count) {
+            lval* err = lval_err("'recur' expected %d arguments, got %d",
+                                 syms->count, x->count);
+            lval_del(x);
+            x = err;
+            break;
+        }
+
+        for (int i = 0; i < syms->count; i++) {
+            lenv_set(f, idx[i], x->cell[i]);
+        }
+        x->count = 0;
+        lval_del(x);
+    }
+    loop_depth--;
+
+    free(idx);
+    lenv_del(f);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_recur(lenv* e, lval* a) {
+    if (loop_depth == 0) {
+        lval_del(a);
+        return lval_err("recur outside of loop");
+    }
+    a->type = LVAL_RECUR;
+    a->hash = 0;
+    return a;
+}
+
+lval* builtin_let(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("let", a, 1);
+    LASSERT_TYPE("let", a, a->count - 1, LVAL_QEXPR);
+
+    lenv* f = lenv_new();
+    f->parent = e;
+
+    if (a->count > 1) {
+        LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+
+        lval* syms = a->cell[0];
+        for (int i = 0; i < syms->count; i++) {
+            if (syms->cell[i]->type != LVAL_SYM) {
+                lval* err = lval_err("'let' cannot bind non-symbol (%s)",
+                                     ltype_name(syms->cell[i]->type));
+                lenv_del(f);
+                lval_del(a);
+                return err;
+            }
+        }
+        if (syms->count != a->count - 2) {
+            lval* err = lval_err("'let' expected %d values, got %d",
+                                 syms->count, a->count - 2);
+            lenv_del(f);
+            lval_del(a);
+            return err;
+        }
+
+        for (int i = 0; i < syms->count; i++) {
+            lenv_put(f, syms->cell[i], a->cell[i + 1]);
+        }
+    }
+
+    lval* body = lval_pop(a, a->count - 1);
+    body->type = LVAL_SEXPR;
+    body->hash = 0;
+    lval* x = lval_eval(f, body);
+
+    lenv_del(f);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_do(lenv* e, lval* a) {
+    if (a->count == 0) {
+        lval_del(a);
+        return lval_qexpr();
+    }
+    return lval_take(a, a->count - 1);
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+    LASSERT_NUM("\\", a, 2);
+    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
+                "cannot define non-symbol (%s)", ltype_name(a->cell[0]->cell[i]->type));
+    }
+
+    lval* formals = lval_pop(a, 0);
+    lval* body = lval_pop(a, 0);
+    lval_del(a);
+
+    /* the body is run as an S-Expression, so expand it as one */
+    lscope scope = { formals, NULL };
+    body->type = LVAL_SEXPR;
+    body = lval_expand(e, body, &scope);
+
+    /* analyse it with the formals bound to placeholders, so a call
+     * through a formal named like a builtin is neither proven nor
+     * folded */
+    lenv* frame = lenv_new();
+    frame->parent = e;
+    for (int i = 0; i < formals->count; i++) {
+        lenv_bind(frame, formals->cell[i], lval_sexpr());
+    }
+    lbuiltin_mark(frame, body, 1);
+    lnum_attach(frame, body);
+    lenv_del(frame);
+    body->type = LVAL_QEXPR;
+
+    lval* f = lval_lambda(formals, body);
+    f->fun->module = lenv_namespace(e);
+    return f;
+}
+
+/* whether k is the name of a builtin that is bound to something else */
+int lbuiltin_shadowed(lval* k) {
+    if (k->type != LVAL_SYM) {
+        return 0;
+    }
+    lbuiltin_desc* d = lbuiltin_named(k->sym);
+    return d && d->shadows;
+}
+
+/* the builtin v's head names or is, NULL for anything else */
+lbuiltin lval_head_builtin(lenv* e, lval* v) {
+    lval* f = v->cell[0];
+    if (f->type == LVAL_SYM) {
+        f = lenv_find(e, f);
+    }
+    return f && f->type == LVAL_FUN ? f->builtin : NULL;
+}
+
+/* whether cell i of v is a branch of an if, which runs as code once
+ * chosen and so is analysed although it is still a Q-Expression */
+int lval_is_branch(lenv* e, lval* v, int i) {
+    return v->type == LVAL_SEXPR && v->count == 4 && i >= 2 &&
+        v->cell[i]->type == LVAL_QEXPR && lval_head_builtin(e, v) == builtin_if;
+}
+
+/* whether cell i of a call to fn is a Q-Expression that runs as code:
+ * the branches of an if, a lambda's body and the bodies of the loops */
+int lval_is_code(lbuiltin fn, lval* v, int i) {
+    if (fn == builtin_if) { return v->count == 4 && i >= 2; }
+    if (fn == builtin_lambda) { return v->count == 3 && i == 2; }
+    if (fn == builtin_dotimes) { return v->count == 4 && i == 3; }
+    if (fn == builtin_for) { return v->count == 5 && i == 4; }
+    if (fn == builtin_while) { return v->count == 3 && i >= 1; }
+    if (fn == builtin_loop) { return v->count >= 3 && i == v->count - 1; }
+    return 0;
+}
+
+int lval_is_builtin(lenv* e, lval* k, lbuiltin fn) {
+    lval* v = lenv_get(e, k);
+    int r = v->type == LVAL_FUN && v->builtin == fn;
+    lval_del(v);
+    return r;
+}
+
+/* marks the lambda v being defined as k for lval_trmc when its body is
+ * {if c {base} {join x (k ...)}} with one argument per formal. if and
+ * join are resolved here, once */
+void lval_trmc_mark(lenv* e, lval* k, lval* v) {
+    if (v->type != LVAL_FUN || v->builtin || v->memo || v->macro ||
+        v->count || v->fun->trmc) {
+        return;
+    }
+    lval* formals = v->fun->formals;
+    lval* body = v->fun->body;
+    for (int i = 0; i < formals->count; i++) {
+        if (strcmp(formals->cell[i]->sym, "&") == 0) {
+            return;
+        }
+    }
+    if (body->count != 4 || body->cell[0]->type != LVAL_SYM ||
+        strcmp(body->cell[0]->sym, "if") != 0 ||
+        body->cell[2]->type != LVAL_QEXPR || body->cell[3]->type != LVAL_QEXPR) {
+        return;
+    }
+
+    int branch = 0;
+    for (int i = 2; i <= 3; i++) {
+        lval* s = body->cell[i];
+        if (s->count != 3 || s->cell[0]->type != LVAL_SYM ||
+            strcmp(s->cell[0]->sym, "join") != 0) {
+            continue;
+        }
+        lval* call = s->cell[2];
+        if (call->type == LVAL_SEXPR && call->count == formals->count + 1 &&
+            call->cell[0]->type == LVAL_SYM && strcmp(call->cell[0]->sym, k->sym) == 0) {
+            if (branch) { return; }
+            branch = i;
+        }
+    }
+    if (!branch || !lval_is_builtin(e, body->cell[0], builtin_if) ||
+        !lval_is_builtin(e, body->cell[branch]->cell[0], builtin_join)) {
+        return;
+    }
+
+    v->fun->trmc = branch;
+    v->fun->self = lval_copy(k);
+}
+
+lval* builtin_defmacro(lenv* e, lval* a) {
+    LASSERT_NUM("defmacro", a, 2);
+    LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("defmacro", a, 1, LVAL_QEXPR);
+
+    lval* syms = a->cell[0];
+    LASSERT(a, (syms->count > 0), "'defmacro' expected a name");
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+                "'defmacro' cannot define non-symbol (%s)", ltype_name(syms->cell[i]->type));
+        LASSERT(a, (strcmp(syms->cell[i]->sym, "&") != 0 || i == syms->count - 2),
+                "'defmacro' symbol '&' not followed by single symbol");
+    }
+
+    lval* formals = lval_pop(a, 0);
+    lval* name = lval_pop(formals, 0);
+    lval* m = lval_lambda(formals, lval_pop(a, 0));
+    m->macro = 1;
+    lenv_def(e, name, m);
+    macro_count++;
+
+    lval_del(name);
+    lval_del(m);
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_var(lenv* e, lval* a, char* func) {
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+    lval* syms = a->cell[0];
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+                "'%s' cannot define non-symbol (%s)",
+                func, ltype_name(syms->cell[i]->type));
+    }
+
+    LASSERT(a, (syms->count == a->count - 1),
+            "'%s' passed too many arguments for symbols", func);
+
+    for (int i = 0; i < syms->count; i++) {
+        /* the stored copy keeps the hash, so later compares are cheap */
+        if (a->cell[i + 1]->type == LVAL_QEXPR || a->cell[i + 1]->type == LVAL_STR) {
+            lval_hash(a->cell[i + 1]);
+        }
+        lval_trmc_mark(e, syms->cell[i], a->cell[i + 1]);
+        if (strcmp(func, "def") == 0) {
+            lenv_def(e, syms->cell[i], a->cell[i + 1]);
+        }
+        if (strcmp(func, "=") == 0) {
+            lenv_put(e, syms->cell[i], a->cell[i + 1]);
+        }
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+    return builtin_var(e, a, "def");
+}
+
+lval* builtin_put(lenv* e, lval* a) {
+    return builtin_var(e, a, "=");
+}
+
+/* the forms in the file at path as an S-Expression */
+lval* lval_read_file(char* path) {
+    mpc_result_t r;
+    if (mpc_parse_contents(path, Bugsp, &r)) {
+        lval* expr = lval_read(r.output);
+        mpc_ast_delete(r.output);
+        return expr;
+    }
+
+    /* parser error */
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+
+    lval* err = lval_err("Could not load library %s", err_msg);
+    free(err_msg);
+    return err;
+}
+
+/* evaluates the forms read from a file one at a time, printing the
+ * errors they give; consumes expr */
+void lenv_load(lenv* e, lval* expr) {
+    while (expr->count) {
+        lval* x = lval_eval(e, lval_expand(e, lval_pop(expr, 0), NULL));
+        if (x->type == LVAL_ERR) {
+            lval_println(x);
+        }
+        lval_del(x);
+    }
+    lval_del(expr);
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+    LASSERT_NUM("load", a, 1);
+    LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+    lval* expr = lval_read_file(a->cell[0]->str);
+    lval_del(a);
+    if (expr->type == LVAL_ERR) {
+        return expr;
+    }
+    lenv_load(e, expr);
+    return lval_sexpr();
+}
+
+/* the canonical path of the module name, which is relative to the file
+ * of the module requiring it or, outside of one, to the working
+ * directory. NULL when there's no such file */
+char* lmodule_path(lenv* e, char* name) {
+    while (e && !e->namespace && !e->module) {
+        e = e->parent;
+    }
+    if (e && !e->namespace) {
+        e = e->module;
+    }
+
+    char* dir = NULL;
+    for (int i = 0; e && name[0] != '/' && i < module_table.count; i++) {
+        if (module_table.items[i].env == e) {
+            dir = module_table.items[i].path;
+        }
+    }
+    if (dir == NULL) {
+        return realpath(name, NULL);
+    }
+
+    /* module paths are canonical, so always have a '/' */
+    int n = strrchr(dir, '/') - dir;
+    char* full = malloc(n + strlen(name) + 2);
+    sprintf(full, "%.*s/%s", n, dir, name);
+    char* path = realpath(full, NULL);
+    free(full);
+    return path;
+}
+
+/* empties a module's namespace so it can be read again in place, where
+ * the lambdas it defined before still look their names up */
+void lenv_clear(lenv* e) {
+    for (int i = 0; i < e->count; i++) {
+        lenv_drop(e, i);
+    }
+    free(e->syms);
+    free(e->vals);
+    e->syms = NULL;
+    e->vals = NULL;
+    e->count = 0;
+    if (e->exports) {
+        lval_del(e->exports);
+        e->exports = NULL;
+    }
+}
+
+/* loads a file into its own namespace once, then copies the names it
+ * exports into the caller's scope; a module is only re-read, into the
+ * same namespace, when its mtime changes. A file that doesn't parse
+ * leaves the table as it was */
+lval* builtin_require(lenv* e, lval* a) {
+    LASSERT_NUM("require", a, 1);
+    LASSERT_TYPE("require", a, 0, LVAL_STR);
+
+    char* path = lmodule_path(e, a->cell[0]->str);
+    struct stat st;
+    if (path == NULL || stat(path, &st) != 0) {
+        lval* err = lval_err("Could not find module %s", a->cell[0]->str);
+        free(path);
+        lval_del(a);
+        return err;
+    }
+
+    lmodule_table* t = &module_table;
+    lmodule* m = NULL;
+    for (int i = 0; i < t->count; i++) {
+        if (strcmp(t->items[i].path, path) == 0) {
+            m = &t->items[i];
+            break;
+        }
+    }
+
+    if (m == NULL || m->mtime != (long)st.st_mtime) {
+        lval* expr = lval_read_file(path);
+        if (expr->type == LVAL_ERR) {
+            free(path);
+            lval_del(a);
+            return expr;
+        }
+
+        /* registered before loading so a cyclic require sees it */
+        lenv* ns;
+        if (m == NULL) {
+            lenv* root = e;
+            while (root->parent) {
+                root = root->parent;
+            }
+            ns = lenv_new();
+            ns->parent = root;
+            ns->namespace = 1;
+
+            t->items = realloc(t->items, sizeof(lmodule) * (t->count + 1));
+            m = &t->items[t->count++];
+            m->path = path;
+            m->env = ns;
+        } else {
+            free(path);
+            ns = m->env;
+            lenv_clear(ns);
+        }
+        m->mtime = (long)st.st_mtime;
+        lenv_load(ns, expr);
+
+        /* the table may have grown while loading */
+        for (int i = 0; i < t->count; i++) {
+            if (t->items[i].env == ns) {
+                m = &t->items[i];
+            }
+        }
+    } else {
+        free(path);
+    }
+
+    lenv* ns = m->env;
+    if (ns->exports) {
+        for (int i = 0; i < ns->exports->count; i++) {
+            lval* k = ns->exports->cell[i];
+            int j = lenv_index(ns, k);
+            if (j < 0) {
+                lval_del(a);
+                return lval_err("module %s exports unbound symbol '%s'", m->path, k->sym);
+            }
+            lenv_def(e, k, ns->vals[j]);
+        }
+    } else {
+        for (int i = 0; i < ns->count; i++) {
+            lval* k = lval_sym(ns->syms[i]);
+            lenv_def(e, k, ns->vals[i]);
+            lval_del(k);
+        }
+    }
+
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_export(lenv* e, lval* a) {
+    LASSERT_NUM("export", a, 1);
+    LASSERT_TYPE("export", a, 0, LVAL_QEXPR);
+
+    lval* syms = a->cell[0];
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+                "'export' cannot export non-symbol (%s)", ltype_name(syms->cell[i]->type));
+    }
+
+    lenv* ns = lenv_namespace(e);
+    LASSERT(a, (ns != NULL), "'export' used outside of a module");
+
+    if (ns->exports == NULL) {
+        ns->exports = lval_qexpr();
+    }
+    ns->exports = lval_join(ns->exports, lval_own(lval_pop(a, 0)));
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_print(lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        lval_print(a->cell[i]);
+        putchar(' ');
+    }
+
+    putchar('\n');
+    lval_del(a);
+
+    return lval_sexpr();
+}
+
+lval* builtin_error(lenv* e, lval* a) {
+    LASSERT_NUM("error", a, 1);
+    LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+    lval* err = lval_err_code(LERR_USER, a->cell[0]->str, 0, 0, 0);
+    lval_del(a);
+    return err;
+}
+
+/* evaluates body, on an error evaluates handler instead with the
+ * error's message bound to the optional symbol */
+lval* builtin_try(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("try", a, 2);
+    LASSERT(a, (a->count <= 3),
+            "'try' too many arguments, expected at most 3, got %d", a->count);
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("try", a, i, LVAL_QEXPR);
+    }
+    if (a->count == 3) {
+        LASSERT(a, (a->cell[1]->count == 1 && a->cell[1]->cell[0]->type == LVAL_SYM),
+                "'try' can only bind a single symbol");
+    }
+
+    lval* x = lval_eval_copy(e, a->cell[0]);
+    if (x->type != LVAL_ERR) {
+        lval_del(a);
+        return x;
+    }
+
+    lenv* f = lenv_new();
+    f->parent = e;
+    if (a->count == 3) {
+        lval* msg = lval_str(lval_err_msg(x));
+        lenv_put(f, a->cell[1]->cell[0], msg);
+        lval_del(msg);
+    }
+    lval_del(x);
+
+    lval* body = lval_pop(a, a->count - 1);
+    body->type = LVAL_SEXPR;
+    body->hash = 0;
+    x = lval_eval(f, body);
+
+    lenv_del(f);
+    lval_del(a);
+    return x;
+}
+
+/* memoisation */
+
+/* (memo f) or (memo f n) to keep at most the n most recently used */
+lval* builtin_memo(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("memo", a, 1);
+    LASSERT(a, (a->count <= 2),
+            "'memo' too many arguments, expected at most 2, got %d", a->count);
+    LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+
+    long cap = 0;
+    if (a->count == 2) {
+        LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+        cap = a->cell[1]->num;
+        LASSERT(a, (cap > 0), "'memo' capacity must be positive, got %li", cap);
+    }
+
+    /* memoising a memo just shares its cache */
+    lval* f = lval_take(a, 0);
+    if (f->memo) {
+        return f;
+    }
+    return lval_memo(lmemo_new(f, cap));
+}
+
+/* {hits misses evictions size} */
+lval* builtin_memo_stats(lenv* e, lval* a) {
+    LASSERT_NUM("memo-stats", a, 1);
+    LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+    LASSERT(a, (a->cell[0]->memo != NULL),
+            "'memo-stats' expected a memoised function");
+
+    lmemo* m = a->cell[0]->memo;
+    lval* r = lval_qexpr();
+    r = lval_add(r, lval_num(m->hits));
+    r = lval_add(r, lval_num(m->misses));
+    r = lval_add(r, lval_num(m->evictions));
+    r = lval_add(r, lval_num(m->count));
+    lval_del(a);
+    return r;
+}
+
+/* list builtins */
+
+lval* builtin_len(lenv* e, lval* a) {
+    LASSERT_NUM("len", a, 1);
+    LFORCE(e, a, 0);
+    if (a->cell[0]->type == LVAL_MAP) {
+        lval* x = lval_num(a->cell[0]->map->count);
+        lval_del(a);
+        return x;
+    }
+    if (a->cell[0]->type == LVAL_ARR) {
+        lval* x = lval_num(a->cell[0]->arr->count);
+        lval_del(a);
+        return x;
+    }
+    if (a->cell[0]->type == LVAL_VEC) {
+        lval* x = lval_num(lval_vec_len(a->cell[0]));
+        lval_del(a);
+        return x;
+    }
+    LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+
+    lval* x = lval_num(a->cell[0]->count);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_empty(lenv* e, lval* a) {
+    LASSERT_NUM("empty?", a, 1);
+    if (a->cell[0]->type == LVAL_SEQ) {
+        return lseq_empty(e, a);
+    }
+
+    lval* x = a->cell[0];
+    long n;
+    switch (x->type) {
+        case LVAL_STR:
+            n = x->str[0] != '\0';
+            break;
+        case LVAL_MAP:
+            n = x->map->count;
+            break;
+        case LVAL_ARR:
+            n = x->arr->count;
+            break;
+        case LVAL_VEC:
+            n = lval_vec_len(x);
+            break;
+        default:
+            LASSERT_TYPE("empty?", a, 0, LVAL_QEXPR);
+            n = x->count;
+            break;
+    }
+
+    lval_del(a);
+    return lval_bool(n == 0);
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+    LASSERT_NUM("nth", a, 2);
+    LFORCE(e, a, 1);
+    if (a->cell[1]->type == LVAL_VEC) {
+        lval* v = lval_pop(a, 1);
+        lval* r = builtin_vec_get(e, lval_add(lval_add(lval_sexpr(), v), lval_take(a, 0)));
+        return r;
+    }
+    LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+    LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+    long n = a->cell[0]->num;
+    LASSERT(a, (n >= 0 && n < a->cell[1]->count),
+            "'nth' index %li out of range for list of length %d",
+            n, a->cell[1]->count);
+
+    lval* x = lval_item(e, a->cell[1], n);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+    LASSERT_NUM("last", a, 1);
+    LFORCE(e, a, 0);
+    LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+    LASSERT(a, (a->cell[0]->count != 0),
+            "'last' passed {}");
+
+    lval* x = lval_item(e, a->cell[0], a->cell[0]->count - 1);
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_map(lenv* e, lval* a) {
+    LASSERT_NUM("map", a, 2);
+    if (a->cell[1]->type == LVAL_SEQ) {
+        return builtin_seq_stage(e, a, "map", LSEQ_MAP);
+    }
+    LASSERT_TYPE("map", a, 0, LVAL_FUN);
+    LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+
+    lval* r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * l->count);
+    for (int i = 0; i < l->count; i++) {
+        lval* x = lval_item(e, l, i);
+        if (x->type != LVAL_ERR) {
+            x = lval_apply(e, f, lval_add(lval_sexpr(), x));
+        }
+        if (x->type == LVAL_ERR) {
+            lval_del(r);
+            lval_del(a);
+            return x;
+        }
+        r->cell[r->count++] = x;
+    }
+
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+    LASSERT_NUM("filter", a, 2);
+    if (a->cell[1]->type == LVAL_SEQ) {
+        return builtin_seq_stage(e, a, "filter", LSEQ_FILTER);
+    }
+    LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+    LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+
+    /* compact the kept items to the front of l in a single pass */
+    int kept = 0;
+    for (int i = 0; i < l->count; i++) {
+        lval* x = lval_item(e, l, i);
+        if (x->type != LVAL_ERR) {
+            x = lval_apply(e, f, lval_add(lval_sexpr(), x));
+        }
+        if (x->type != LVAL_BOOL) {
+            lval* err = x;
+            if (x->type != LVAL_ERR) {
+                err = lval_err("'filter' predicate must return %s, got %s",
+                               ltype_name(LVAL_BOOL), ltype_name(x->type));
+                lval_del(x);
+            }
+            for (int j = i; j < l->count; j++) {
+                lval_del(l->cell[j]);
+            }
+            l->count = kept;
+            lval_del(a);
+            return err;
+        }
+
+        if (x->num) {
+            l->cell[kept++] = l->cell[i];
+        } else {
+            lval_del(l->cell[i]);
+        }
+        lval_del(x);
+    }
+    l->count = kept;
+    lval_forget(l);
+
+    return lval_take(a, 1);
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+    LASSERT_NUM("foldl", a, 3);
+    LFORCE(e, a, 2);
+    LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[2];
+
+    lval* z = a->cell[1];
+    a->cell[1] = lval_sexpr();
+    for (int i = 0; i < l->count; i++) {
+        lval* x = lval_item(e, l, i);
+        if (x->type == LVAL_ERR) {
+            lval_del(z);
+            z = x;
+            break;
+        }
+
+        lval* args = lval_sexpr();
+        args = lval_add(args, z);
+        args = lval_add(args, x);
+        z = lval_apply(e, f, args);
+        if (z->type == LVAL_ERR) {
+            break;
+        }
+    }
+
+    lval_del(a);
+    return z;
+}
+
+lval* builtin_foldr(lenv* e, lval* a) {
+    LASSERT_NUM("foldr", a, 3);
+    LFORCE(e, a, 2);
+    LASSERT_TYPE("foldr", a, 0, LVAL_FUN);
+    LASSERT_TYPE("foldr", a, 2, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[2];
+
+    lval* z = a->cell[1];
+    a->cell[1] = lval_sexpr();
+    for (int i = l->count - 1; i >= 0; i--) {
+        lval* x = lval_item(e, l, i);
+        if (x->type == LVAL_ERR) {
+            lval_del(z);
+            z = x;
+            break;
+        }
+
+        lval* args = lval_sexpr();
+        args = lval_add(args, x);
+        args = lval_add(args, z);
+        z = lval_apply(e, f, args);
+        if (z->type == LVAL_ERR) {
+            break;
+        }
+    }
+
+    lval_del(a);
+    return z;
+}
+
+lval* builtin_reverse(lenv* e, lval* a) {
+    LASSERT_NUM("reverse", a, 1);
+    LFORCE(e, a, 0);
+    LASSERT_TYPE("reverse", a, 0, LVAL_QEXPR);
+
+    lval* l = lval_take(a, 0);
+    lval_forget(l);
+    for (int i = 0, j = l->count - 1; i < j; i++, j--) {
+        lval* t = l->cell[i];
+        l->cell[i] = l->cell[j];
+        l->cell[j] = t;
+    }
+    return l;
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+    LASSERT_NUM("take", a, 2);
+    if (a->cell[1]->type == LVAL_SEQ) {
+        return builtin_seq_stage(e, a, "take", LSEQ_TAKE);
+    }
+    LASSERT_TYPE("take", a, 0, LVAL_NUM);
+    LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+
+    long n = a->cell[0]->num;
+    LASSERT(a, (n >= 0 && n <= a->cell[1]->count),
+            "'take' index %li out of range for list of length %d",
+            n, a->cell[1]->count);
+
+    lval* l = lval_take(a, 1);
+    for (int i = n; i < l->count; i++) {
+        lval_del(l->cell[i]);
+    }
+    l->count = n;
+    l->hash = 0;
+    return l;
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+    LASSERT_NUM("drop", a, 2);
+    LFORCE(e, a, 1);
+    LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+    LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
+
+    long n = a->cell[0]->num;
+    LASSERT(a, (n >= 0 && n <= a->cell[1]->count),
+            "'drop' index %li out of range for list of length %d",
+            n, a->cell[1]->count);
+
+    lval* l = lval_take(a, 1);
+    for (int i = 0; i < n; i++) {
+        lval_del(l->cell[i]);
+    }
+    memmove(&l->cell[0], &l->cell[n], sizeof(lval*) * (l->count - n));
+    l->count -= n;
+    l->hash = 0;
+    return l;
+}
+
+lval* builtin_elem(lenv* e, lval* a) {
+    LASSERT_NUM("elem", a, 2);
+    LFORCE(e, a, 1);
+    LASSERT_TYPE("elem", a, 1, LVAL_QEXPR);
+
+    lval* l = a->cell[1];
+    int found = 0;
+    for (int i = 0; i < l->count && !found; i++) {
+        lval* x = lval_item(e, l, i);
+        if (x->type == LVAL_ERR) {
+            lval_del(a);
+            return x;
+        }
+        found = lval_eq(x, a->cell[0]);
+        lval_del(x);
+    }
+
+    lval_del(a);
+    return lval_bool(found);
+}
+
+lval* builtin_zip(lenv* e, lval* a) {
+    LASSERT_NUM("zip", a, 2);
+    LFORCE(e, a, 0);
+    LFORCE(e, a, 1);
+    LASSERT_TYPE("zip", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("zip", a, 1, LVAL_QEXPR);
+
+    lval* x = a->cell[0];
+    lval* y = a->cell[1];
+    int n = x->count < y->count ? x->count : y->count;
+
+    /* move the items across rather than copying them */
+    lval* r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * n);
+    for (int i = 0; i < n; i++) {
+        lval* pair = lval_qexpr();
+        pair = lval_add(pair, x->cell[i]);
+        pair = lval_add(pair, y->cell[i]);
+        r->cell[r->count++] = pair;
+    }
+    memmove(&x->cell[0], &x->cell[n], sizeof(lval*) * (x->count - n));
+    memmove(&y->cell[0], &y->cell[n], sizeof(lval*) * (y->count - n));
+    x->count -= n;
+    y->count -= n;
+
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_unzip(lenv* e, lval* a) {
+    LASSERT_NUM("unzip", a, 1);
+    LFORCE(e, a, 0);
+    LASSERT_TYPE("unzip", a, 0, LVAL_QEXPR);
+
+    lval* l = a->cell[0];
+    lval* fsts = lval_qexpr();
+    lval* rest = lval_qexpr();
+    fsts->cell = malloc(sizeof(lval*) * l->count);
+    for (int i = 0; i < l->count; i++) {
+        lval* x = lval_item(e, l, i);
+        if (x->type != LVAL_QEXPR || x->count == 0) {
+            lval* err = x;
+            if (x->type != LVAL_ERR) {
+                err = lval_err("'unzip' item %d must be a non-empty %s, got %s",
+                               i, ltype_name(LVAL_QEXPR), ltype_name(x->type));
+                lval_del(x);
+            }
+            lval_del(fsts);
+            lval_del(rest);
+            lval_del(a);
+            return err;
+        }
+
+        fsts->cell[fsts->count++] = x->cell[0];
+        for (int j = 1; j < x->count; j++) {
+            rest = lval_add(rest, x->cell[j]);
+        }
+        x->count = 0;
+        lval_del(x);
+    }
+
+    lval_del(a);
+    lval* r = lval_qexpr();
+    r = lval_add(r, fsts);
+    r = lval_add(r, rest);
+    return r;
+}
+
+/* shared by sum & product, which are folds of + and * */
+lval* builtin_reduce_num(lenv* e, lval* a, char* func, long z, int mul) {
+    LASSERT_NUM(func, a, 1);
+    LFORCE(e, a, 0);
+    if (a->cell[0]->type == LVAL_ARR) {
+        return builtin_array_fold(e, a, func, mul ? 'p' : 's');
+    }
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+    lval* l = a->cell[0];
+    for (int i = 0; i < l->count; i++) {
+        lval* x = lval_item(e, l, i);
+        if (x->type != LVAL_NUM) {
+            lval* err = x;
+            if (x->type != LVAL_ERR) {
+                err = lval_err("'%s' incorrect type for item %d, expected %s, got %s",
+                               func, i, ltype_name(LVAL_NUM), ltype_name(x->type));
+                lval_del(x);
+            }
+            lval_del(a);
+            return err;
+        }
+        if (mul) {
+            z *= x->num;
+        } else {
+            z += x->num;
+        }
+        lval_del(x);
+    }
+
+    lval_del(a);
+    return lval_num(z);
+}
+
+lval* builtin_sum(lenv* e, lval* a) {
+    return builtin_reduce_num(e, a, "sum", 0, 0);
+}
+
+lval* builtin_product(lenv* e, lval* a) {
+    return builtin_reduce_num(e, a, "product", 1, 1);
+}
+
+lval* builtin_takewhile(lenv* e, lval* a) {
+    LASSERT_NUM("takewhile", a, 2);
+    if (a->cell[1]->type == LVAL_SEQ) {
+        return builtin_seq_stage(e, a, "takewhile", LSEQ_TAKEWHILE);
+    }
+    LASSERT_TYPE("takewhile", a, 0, LVAL_FUN);
+    LASSERT_TYPE("takewhile", a, 1, LVAL_QEXPR);
+
+    lval* f = a->cell[0];
+    lval* l = a->cell[1];
+
+    int n = 0;
+    while (n < l->count) {
+        lval* x = lval_item(e, l, n);
+        if (x->type != LVAL_ERR) {
+            x = lval_apply(e, f, lval_add(lval_sexpr(), x));
+        }
+        if (x->type != LVAL_BOOL) {
+            lval* err = x;
+            if (x->type != LVAL_ERR) {
+                err = lval_err("'takewhile' predicate must return %s, got %s",
+                               ltype_name(LVAL_BOOL), ltype_name(x->type));
+                lval_del(x);
+            }
+            lval_del(a);
+            return err;
+        }
+
+        int keep = x->num;
+        lval_del(x);
+        if (!keep) {
+            break;
+        }
+        n++;
+    }
+
+    for (int i = n; i < l->count; i++) {
+        lval_del(l->cell[i]);
+    }
+    l->count = n;
+    l->hash = 0;
+    return lval_take(a, 1);
+}
+
+/* sorting */
+
+/* LSD radix sort on the (sign flipped) keys, one byte per pass; the
+ * sorted result ends up back in items */
+void lsort_radix(lsort_item* items, lsort_item* tmp, long n) {
+    if (n < 2) {
+        return;
+    }
+
+    lsort_item* src = items;
+    lsort_item* dst = tmp;
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        long counts[256] = {0};
+        for (long i = 0; i < n; i++) {
+            counts[(src[i].key >> shift) & 0xff]++;
+        }
+
+        /* every key shares this byte, the pass would be a no-op */
+        if (counts[(src[0].key >> shift) & 0xff] == n) {
+            continue;
+        }
+
+        long pos = 0;
+        for (int b = 0; b < 256; b++) {
+            long c = counts[b];
+            counts[b] = pos;
+            pos += c;
+        }
+        for (long i = 0; i < n; i++) {
+            dst[counts[(src[i].key >> shift) & 0xff]++] = src[i];
+        }
+
+        lsort_item* t = src;
+        src = dst;
+        dst = t;
+    }
+
+    if (src != items) {
+        memcpy(items, src, sizeof(lsort_item) * n);
+    }
+}
+
+/* stable merge of the sorted runs [lo, mid) and [mid, hi) */
+void lsort_merge(lsort_item* items, lsort_item* tmp, long lo, long mid, long hi, int ints) {
+    long i = lo, j = mid, k = lo;
+    while (i < mid && j < hi) {
+        int right = ints ? items[j].key < items[i].key
+                         : lval_cmp(items[j].k, items[i].k) < 0;
+        tmp[k++] = right ? items[j++] : items[i++];
+    }
+    while (i < mid) {
+        tmp[k++] = items[i++];
+    }
+    while (j < hi) {
+        tmp[k++] = items[j++];
+    }
+    memcpy(&items[lo], &tmp[lo], sizeof(lsort_item) * (hi - lo));
+}
+
+void lsort_mergesort(lsort_item* items, lsort_item* tmp, long lo, long hi) {
+    if (hi - lo < 2) {
+        return;
+    }
+
+    long mid = lo + (hi - lo) / 2;
+    lsort_mergesort(items, tmp, lo, mid);
+    lsort_mergesort(items, tmp, mid, hi);
+    lsort_merge(items, tmp, lo, mid, hi, 0);
+}
+
+void* lsort_chunk_worker(void* arg) {
+    lsort_job* j = arg;
+    if (j->ints) {
+        lsort_radix(&j->items[j->lo], &j->tmp[j->lo], j->hi - j->lo);
+    } else {
+        lsort_mergesort(j->items, j->tmp, j->lo, j->hi);
+    }
+    return NULL;
+}
+
+void* lsort_merge_worker(void* arg) {
+    lsort_job* j = arg;
+    lsort_merge(j->items, j->tmp, j->lo, j->mid, j->hi, j->ints);
+    return NULL;
+}
+
+/* sorts small inputs in place, larger ones are split into chunks sorted
+ * on worker threads and then merged pairwise, also in parallel */
+void lsort_items(lsort_item* items, long n, int ints) {
+    lsort_item* tmp = malloc(sizeof(lsort_item) * (n ? n : 1));
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > SORT_MAX_THREADS ? SORT_MAX_THREADS : cpus;
+    if (n < SORT_PARALLEL_MIN || threads < 2) {
+        lsort_job j = { items, tmp, 0, 0, n, ints };
+        lsort_chunk_worker(&j);
+        free(tmp);
+        return;
+    }
+
+    long bounds[SORT_MAX_THREADS + 1];
+    for (int i = 0; i <= threads; i++) {
+        bounds[i] = n * i / threads;
+    }
+
+    pthread_t tids[SORT_MAX_THREADS];
+    lsort_job jobs[SORT_MAX_THREADS];
+    int started[SORT_MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        jobs[i] = (lsort_job){ items, tmp, bounds[i], 0, bounds[i + 1], ints };
+        started[i] = pthread_create(&tids[i], NULL, lsort_chunk_worker, &jobs[i]) == 0;
+        if (!started[i]) {
+            lsort_chunk_worker(&jobs[i]);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+    }
+
+    /* each round merges neighbouring runs, halving their number */
+    int runs = threads;
+    while (runs > 1) {
+        int merges = 0;
+        for (int i = 0; i + 1 < runs; i += 2) {
+            jobs[merges] = (lsort_job){ items, tmp, bounds[i], bounds[i + 1], bounds[i + 2], ints };
+            started[merges] = pthread_create(&tids[merges], NULL, lsort_merge_worker, &jobs[merges]) == 0;
+            if (!started[merges]) {
+                lsort_merge_worker(&jobs[merges]);
+            }
+            merges++;
+        }
+        for (int i = 0; i < merges; i++) {
+            if (started[i]) {
+                pthread_join(tids[i], NULL);
+            }
+        }
+
+        int next = 0;
+        for (int i = 0; i < runs; i += 2) {
+            bounds[next++] = bounds[i];
+        }
+        bounds[next] = n;
+        runs = next;
+    }
+
+    free(tmp);
+}
+
+/* sorts the list in a->cell[a->count - 1], on the items themselves or
+ * on the keys f gives for them when f is not NULL */
+lval* builtin_sort_list(lenv* e, lval* a, lval* f) {
+    lval* l = a->cell[a->count - 1];
+    long n = l->count;
+
+    lsort_item* items = malloc(sizeof(lsort_item) * (n ? n : 1));
+    int ints = 1;
+    for (long i = 0; i < n; i++) {
+        items[i].v = l->cell[i];
+        items[i].k = l->cell[i];
+        if (f) {
+            lval* k = lval_item(e, l, i);
+            if (k->type != LVAL_ERR) {
+                k = lval_apply(e, f, lval_add(lval_sexpr(), k));
+            }
+            if (k->type == LVAL_ERR) {
+                for (long j = 0; j < i; j++) {
+                    lval_del(items[j].k);
+                }
+                free(items);
+                lval_del(a);
+                return k;
+            }
+            items[i].k = k;
+        }
+        if (items[i].k->type == LVAL_NUM) {
+            items[i].key = (unsigned long)items[i].k->num ^ (1UL << 63);
+        } else {
+            ints = 0;
+        }
+    }
+
+    lsort_items(items, n, ints);
+    lval_forget(l);
+
+    for (long i = 0; i < n; i++) {
+        l->cell[i] = items[i].v;
+        if (f) {
+            lval_del(items[i].k);
+        }
+    }
+    free(items);
+
+    return lval_take(a, a->count - 1);
+}
+
+lval* builtin_sort(lenv* e, lval* a) {
+    LASSERT_NUM("sort", a, 1);
+    LFORCE(e, a, 0);
+    LASSERT_TYPE("sort", a, 0, LVAL_QEXPR);
+
+    return builtin_sort_list(e, a, NULL);
+}
+
+lval* builtin_sort_by(lenv* e, lval* a) {
+    LASSERT_NUM("sort-by", a, 2);
+    LFORCE(e, a, 1);
+    LASSERT_TYPE("sort-by", a, 0, LVAL_FUN);
+    LASSERT_TYPE("sort-by", a, 1, LVAL_QEXPR);
+
+    return builtin_sort_list(e, a, a->cell[0]);
+}
+
+/* hash map builtins */
+
+lval* builtin_hash_map(lenv* e, lval* a) {
+    /* (hash-map {k v ...}) also works, so an empty map is (hash-map {}) */
+    if (a->count == 1 && a->cell[0]->type == LVAL_QEXPR) {
+        a = lval_take(a, 0);
+        a->type = LVAL_SEXPR;
+        a->hash = 0;
+    }
+    LASSERT(a, (a->count % 2 == 0),
+            "'hash-map' expects key value pairs, got %d arguments", a->count);
+
+    lmap* m = lmap_new(NULL, 0);
+    for (int i = 0; i < a->count; i += 2) {
+        lmap_put(m, a->cell[i], a->cell[i + 1]);
     }
+    /* the keys & values now belong to the map */
+    a->count = 0;
     lval_del(a);
-    return x;
+
+    return lval_map(m);
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-    LASSERT_NUM_MIN("+", a, 2);
+lval* builtin_hash_get(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("hash-get", a, 2);
+    LASSERT(a, (a->count <= 3),
+            "'hash-get' too many arguments, expected at most 3, got %d", a->count);
+    LASSERT_TYPE("hash-get", a, 0, LVAL_MAP);
 
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE("+", a, i, LVAL_NUM);
+    lmap_node* n = lmap_find(a->cell[0]->map, a->cell[1], lval_hash(a->cell[1]));
+    if (n) {
+        lval* x = lval_copy(n->val);
+        lval_del(a);
+        return x;
+    }
+    if (a->count == 3) {
+        return lval_take(a, 2);
     }
 
-    lval* x = lval_pop(a, 0);
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-        x->num += y->num;
-        lval_del(y);
+    lval_del(a);
+    return lval_err("'hash-get' key not found");
+}
+
+lval* builtin_hash_has(lenv* e, lval* a) {
+    LASSERT_NUM("hash-has", a, 2);
+    LASSERT_TYPE("hash-has", a, 0, LVAL_MAP);
+
+    int found = lmap_find(a->cell[0]->map, a->cell[1], lval_hash(a->cell[1])) != NULL;
+    lval_del(a);
+    return lval_bool(found);
+}
+
+/* with cow set a shared map is forked before being written to, sharing
+ * all but the nodes the put copies; otherwise every copy sees the change */
+lval* builtin_hash_set(lenv* e, lval* a, char* func, int cow) {
+    LASSERT_NUM(func, a, 3);
+    LASSERT_TYPE(func, a, 0, LVAL_MAP);
+
+    lval* v = lval_pop(a, 2);
+    lval* k = lval_pop(a, 1);
+    lval* m = lval_take(a, 0);
+    if (cow && m->map->refs > 1) {
+        m->map = lmap_fork(m->map);
+    }
+
+    lmap_put(m->map, k, v);
+    return m;
+}
+
+lval* builtin_hash_put(lenv* e, lval* a) {
+    return builtin_hash_set(e, a, "hash-put", 1);
+}
+
+lval* builtin_hash_put_mut(lenv* e, lval* a) {
+    return builtin_hash_set(e, a, "hash-put!", 0);
+}
+
+lval* builtin_hash_unset(lenv* e, lval* a, char* func, int cow) {
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_MAP);
+
+    lval* k = lval_pop(a, 1);
+    lval* m = lval_take(a, 0);
+    if (lmap_find(m->map, k, lval_hash(k))) {
+        if (cow && m->map->refs > 1) {
+            m->map = lmap_fork(m->map);
+        }
+        lmap_remove(m->map, k);
+    }
+
+    lval_del(k);
+    return m;
+}
+
+lval* builtin_hash_del(lenv* e, lval* a) {
+    return builtin_hash_unset(e, a, "hash-del", 1);
+}
+
+lval* builtin_hash_del_mut(lenv* e, lval* a) {
+    return builtin_hash_unset(e, a, "hash-del!", 0);
+}
+
+/* what: 0 keys, 1 values, 2 {key value} pairs */
+lval* builtin_hash_list(lenv* e, lval* a, char* func, int what) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_MAP);
+
+    lmap* m = a->cell[0]->map;
+    lmap_node** xs = lmap_leaves(m->root, m->count);
+    lval* r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * (m->count ? m->count : 1));
+    for (long i = 0; i < m->count; i++) {
+        if (what == 0) {
+            r->cell[r->count++] = lval_copy(xs[i]->key);
+        } else if (what == 1) {
+            r->cell[r->count++] = lval_copy(xs[i]->val);
+        } else {
+            lval* pair = lval_qexpr();
+            pair = lval_add(pair, lval_copy(xs[i]->key));
+            pair = lval_add(pair, lval_copy(xs[i]->val));
+            r->cell[r->count++] = pair;
+        }
     }
+    free(xs);
 
     lval_del(a);
-    return x;
+    return r;
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-    LASSERT_NUM_MIN("-", a, 1);
+lval* builtin_hash_keys(lenv* e, lval* a) {
+    return builtin_hash_list(e, a, "hash-keys", 0);
+}
 
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE("-", a, i, LVAL_NUM);
+lval* builtin_hash_vals(lenv* e, lval* a) {
+    return builtin_hash_list(e, a, "hash-vals", 1);
+}
+
+lval* builtin_hash_items(lenv* e, lval* a) {
+    return builtin_hash_list(e, a, "hash-items", 2);
+}
+
+/* calls f with each key & value, stopping at the first error */
+lval* builtin_hash_each(lenv* e, lval* a) {
+    LASSERT_NUM("hash-each", a, 2);
+    LASSERT_TYPE("hash-each", a, 0, LVAL_FUN);
+    LASSERT_TYPE("hash-each", a, 1, LVAL_MAP);
+
+    /* hold our own reference to the nodes in case f rewrites the map
+     * under us, any put then copies the nodes it changes */
+    lmap_node* root = a->cell[1]->map->root;
+    long count = a->cell[1]->map->count;
+    lmap_node** xs = lmap_leaves(root, count);
+    if (root) {
+        root->refs++;
+    }
+    lval* r = NULL;
+    for (long i = 0; r == NULL && i < count; i++) {
+        lval* args = lval_sexpr();
+        args = lval_add(args, lval_copy(xs[i]->key));
+        args = lval_add(args, lval_copy(xs[i]->val));
+        lval* x = lval_apply(e, a->cell[0], args);
+        if (x->type == LVAL_ERR) {
+            r = x;
+        } else {
+            lval_del(x);
+        }
     }
 
-    lval* x = lval_pop(a, 0);
-    if (a->count == 0) {
-        x->num = -x->num;
+    free(xs);
+    if (root) {
+        lmap_node_del(root);
+    }
+    lval_del(a);
+    return r ? r : lval_sexpr();
+}
+
+/* array kernels */
+
+/* unsigned so overflow wraps the same way the vector lanes do */
+long larr_sum_scalar(const long* x, long n) {
+    unsigned long r = 0;
+    for (long i = 0; i < n; i++) {
+        r += x[i];
+    }
+    return r;
+}
+
+long larr_min_scalar(const long* x, long n) {
+    long r = x[0];
+    for (long i = 1; i < n; i++) {
+        r = x[i] < r ? x[i] : r;
+    }
+    return r;
+}
+
+long larr_max_scalar(const long* x, long n) {
+    long r = x[0];
+    for (long i = 1; i < n; i++) {
+        r = x[i] > r ? x[i] : r;
+    }
+    return r;
+}
+
+void larr_add_scalar(long* r, const long* x, const long* y, long n) {
+    for (long i = 0; i < n; i++) {
+        r[i] = (unsigned long)x[i] + y[i];
+    }
+}
+
+void larr_sub_scalar(long* r, const long* x, const long* y, long n) {
+    for (long i = 0; i < n; i++) {
+        r[i] = (unsigned long)x[i] - y[i];
+    }
+}
+
+/* neither SSE nor AVX2 has a 64 bit multiply, so these stay scalar
+ * with independent accumulators to keep the multipliers busy */
+long larr_product(const long* x, long n) {
+    unsigned long r[4] = {1, 1, 1, 1};
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        r[0] *= x[i];
+        r[1] *= x[i + 1];
+        r[2] *= x[i + 2];
+        r[3] *= x[i + 3];
+    }
+    for (; i < n; i++) {
+        r[0] *= x[i];
+    }
+    return r[0] * r[1] * r[2] * r[3];
+}
+
+long larr_dot(const long* x, const long* y, long n) {
+    unsigned long r[4] = {0, 0, 0, 0};
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        r[0] += (unsigned long)x[i] * y[i];
+        r[1] += (unsigned long)x[i + 1] * y[i + 1];
+        r[2] += (unsigned long)x[i + 2] * y[i + 2];
+        r[3] += (unsigned long)x[i + 3] * y[i + 3];
+    }
+    for (; i < n; i++) {
+        r[0] += (unsigned long)x[i] * y[i];
+    }
+    return r[0] + r[1] + r[2] + r[3];
+}
+
+#ifdef BUGSP_X86
+
+__attribute__((target("avx2")))
+long larr_sum_avx2(const long* x, long n) {
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    long i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_epi64(acc0, _mm256_loadu_si256((const __m256i*)&x[i]));
+        acc1 = _mm256_add_epi64(acc1, _mm256_loadu_si256((const __m256i*)&x[i + 4]));
+    }
+    long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(acc0, acc1));
+    unsigned long r = (unsigned long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return r + larr_sum_scalar(&x[i], n - i);
+}
+
+__attribute__((target("avx2")))
+long larr_min_avx2(const long* x, long n) {
+    if (n < 4) {
+        return larr_min_scalar(x, n);
+    }
+    __m256i acc = _mm256_loadu_si256((const __m256i*)x);
+    long i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&x[i]);
+        acc = _mm256_blendv_epi8(acc, v, _mm256_cmpgt_epi64(acc, v));
+    }
+    long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    long r = larr_min_scalar(lanes, 4);
+    if (i < n) {
+        long t = larr_min_scalar(&x[i], n - i);
+        r = t < r ? t : r;
+    }
+    return r;
+}
+
+__attribute__((target("avx2")))
+long larr_max_avx2(const long* x, long n) {
+    if (n < 4) {
+        return larr_max_scalar(x, n);
+    }
+    __m256i acc = _mm256_loadu_si256((const __m256i*)x);
+    long i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&x[i]);
+        acc = _mm256_blendv_epi8(acc, v, _mm256_cmpgt_epi64(v, acc));
+    }
+    long lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    long r = larr_max_scalar(lanes, 4);
+    if (i < n) {
+        long t = larr_max_scalar(&x[i], n - i);
+        r = t > r ? t : r;
+    }
+    return r;
+}
+
+__attribute__((target("avx2")))
+void larr_add_avx2(long* r, const long* x, const long* y, long n) {
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)&x[i]),
+                                     _mm256_loadu_si256((const __m256i*)&y[i]));
+        _mm256_storeu_si256((__m256i*)&r[i], v);
+    }
+    larr_add_scalar(&r[i], &x[i], &y[i], n - i);
+}
+
+__attribute__((target("avx2")))
+void larr_sub_avx2(long* r, const long* x, const long* y, long n) {
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_sub_epi64(_mm256_loadu_si256((const __m256i*)&x[i]),
+                                     _mm256_loadu_si256((const __m256i*)&y[i]));
+        _mm256_storeu_si256((__m256i*)&r[i], v);
+    }
+    larr_sub_scalar(&r[i], &x[i], &y[i], n - i);
+}
+
+__attribute__((target("sse4.2")))
+long larr_sum_sse(const long* x, long n) {
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_epi64(acc0, _mm_loadu_si128((const __m128i*)&x[i]));
+        acc1 = _mm_add_epi64(acc1, _mm_loadu_si128((const __m128i*)&x[i + 2]));
+    }
+    long lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc0, acc1));
+    unsigned long r = (unsigned long)lanes[0] + lanes[1];
+    return r + larr_sum_scalar(&x[i], n - i);
+}
+
+__attribute__((target("sse4.2")))
+long larr_min_sse(const long* x, long n) {
+    if (n < 2) {
+        return larr_min_scalar(x, n);
+    }
+    __m128i acc = _mm_loadu_si128((const __m128i*)x);
+    long i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&x[i]);
+        acc = _mm_blendv_epi8(acc, v, _mm_cmpgt_epi64(acc, v));
+    }
+    long lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    long r = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    return (i < n && x[i] < r) ? x[i] : r;
+}
+
+__attribute__((target("sse4.2")))
+long larr_max_sse(const long* x, long n) {
+    if (n < 2) {
+        return larr_max_scalar(x, n);
+    }
+    __m128i acc = _mm_loadu_si128((const __m128i*)x);
+    long i = 2;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&x[i]);
+        acc = _mm_blendv_epi8(acc, v, _mm_cmpgt_epi64(v, acc));
+    }
+    long lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    long r = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    return (i < n && x[i] > r) ? x[i] : r;
+}
+
+__attribute__((target("sse4.2")))
+void larr_add_sse(long* r, const long* x, const long* y, long n) {
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_add_epi64(_mm_loadu_si128((const __m128i*)&x[i]),
+                                  _mm_loadu_si128((const __m128i*)&y[i]));
+        _mm_storeu_si128((__m128i*)&r[i], v);
+    }
+    larr_add_scalar(&r[i], &x[i], &y[i], n - i);
+}
+
+__attribute__((target("sse4.2")))
+void larr_sub_sse(long* r, const long* x, const long* y, long n) {
+    long i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_sub_epi64(_mm_loadu_si128((const __m128i*)&x[i]),
+                                  _mm_loadu_si128((const __m128i*)&y[i]));
+        _mm_storeu_si128((__m128i*)&r[i], v);
+    }
+    larr_sub_scalar(&r[i], &x[i], &y[i], n - i);
+}
+
+#endif
+
+void larr_init_kernels(void) {
+    arr_kernels = (larr_kernels){
+        "scalar", larr_sum_scalar, larr_min_scalar, larr_max_scalar,
+        larr_add_scalar, larr_sub_scalar
+    };
+
+#ifdef BUGSP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        arr_kernels = (larr_kernels){
+            "avx2", larr_sum_avx2, larr_min_avx2, larr_max_avx2,
+            larr_add_avx2, larr_sub_avx2
+        };
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        arr_kernels = (larr_kernels){
+            "sse4.2", larr_sum_sse, larr_min_sse, larr_max_sse,
+            larr_add_sse, larr_sub_sse
+        };
+    }
+#endif
+}
+
+/* array builtins */
+
+/* from a list or sequence of numbers, a sequence is streamed straight
+ * into the array without building a list first */
+lval* builtin_array(lenv* e, lval* a) {
+    LASSERT_NUM("array", a, 1);
+
+    if (a->cell[0]->type == LVAL_SEQ) {
+        long cap = 64;
+        larr* r = larr_new(cap);
+        r->count = 0;
+
+        lval* x;
+        while ((x = lseq_next(e, a->cell[0]->seq))) {
+            if (x->type != LVAL_NUM) {
+                lval* err = x;
+                if (x->type != LVAL_ERR) {
+                    err = lval_err("'array' incorrect type for item %li, expected %s, got %s",
+                                   r->count, ltype_name(LVAL_NUM), ltype_name(x->type));
+                    lval_del(x);
+                }
+                larr_del(r);
+                lval_del(a);
+                return err;
+            }
+            if (r->count == cap) {
+                cap *= 2;
+                r->data = realloc(r->data, sizeof(long) * cap);
+            }
+            r->data[r->count++] = x->num;
+            lval_del(x);
+        }
+
+        lval_del(a);
+        return lval_arr(r);
+    }
+
+    LASSERT_TYPE("array", a, 0, LVAL_QEXPR);
+
+    lval* l = a->cell[0];
+    larr* r = larr_new(l->count);
+    for (int i = 0; i < l->count; i++) {
+        if (l->cell[i]->type != LVAL_NUM) {
+            lval* err = lval_err("'array' incorrect type for item %d, expected %s, got %s",
+                                 i, ltype_name(LVAL_NUM), ltype_name(l->cell[i]->type));
+            larr_del(r);
+            lval_del(a);
+            return err;
+        }
+        r->data[i] = l->cell[i]->num;
+    }
+
+    lval_del(a);
+    return lval_arr(r);
+}
+
+lval* builtin_array_list(lenv* e, lval* a) {
+    LASSERT_NUM("array-list", a, 1);
+    LASSERT_TYPE("array-list", a, 0, LVAL_ARR);
+
+    larr* x = a->cell[0]->arr;
+    lval* r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * (x->count ? x->count : 1));
+    for (long i = 0; i < x->count; i++) {
+        r->cell[r->count++] = lval_num(x->data[i]);
     }
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-        x->num -= y->num;
-        lval_del(y);
+
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_array_range(lenv* e, lval* a) {
+    LASSERT_NUM("array-range", a, 2);
+    LASSERT_TYPE("array-range", a, 0, LVAL_NUM);
+    LASSERT_TYPE("array-range", a, 1, LVAL_NUM);
+
+    long lo = a->cell[0]->num;
+    long hi = a->cell[1]->num;
+    larr* r = larr_new(hi > lo ? hi - lo : 0);
+    for (long i = 0; i < r->count; i++) {
+        r->data[i] = lo + i;
     }
 
+    lval_del(a);
+    return lval_arr(r);
+}
+
+lval* builtin_array_get(lenv* e, lval* a) {
+    LASSERT_NUM("array-get", a, 2);
+    LASSERT_TYPE("array-get", a, 0, LVAL_ARR);
+    LASSERT_TYPE("array-get", a, 1, LVAL_NUM);
+
+    long i = a->cell[1]->num;
+    LASSERT(a, (i >= 0 && i < a->cell[0]->arr->count),
+            "'array-get' index %li out of range for array of length %li",
+            i, a->cell[0]->arr->count);
+
+    lval* x = lval_num(a->cell[0]->arr->data[i]);
     lval_del(a);
     return x;
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-    LASSERT_NUM_MIN("*", a, 2);
+/* op: 's'um, 'p'roduct, 'm'in or 'M'ax */
+lval* builtin_array_fold(lenv* e, lval* a, char* func, int op) {
+    LASSERT_NUM(func, a, 1);
+    LASSERT_TYPE(func, a, 0, LVAL_ARR);
+
+    larr* x = a->cell[0]->arr;
+    if (op == 'm' || op == 'M') {
+        LASSERT(a, (x->count != 0), "'%s' passed an empty array", func);
+    }
+
+    long r = 0;
+    switch (op) {
+        case 's': r = arr_kernels.sum(x->data, x->count); break;
+        case 'p': r = larr_product(x->data, x->count); break;
+        case 'm': r = arr_kernels.min(x->data, x->count); break;
+        case 'M': r = arr_kernels.max(x->data, x->count); break;
+    }
+
+    lval_del(a);
+    return lval_num(r);
+}
+
+lval* builtin_array_sum(lenv* e, lval* a) {
+    return builtin_array_fold(e, a, "array-sum", 's');
+}
+
+lval* builtin_array_product(lenv* e, lval* a) {
+    return builtin_array_fold(e, a, "array-product", 'p');
+}
+
+lval* builtin_array_min(lenv* e, lval* a) {
+    return builtin_array_fold(e, a, "array-min", 'm');
+}
+
+lval* builtin_array_max(lenv* e, lval* a) {
+    return builtin_array_fold(e, a, "array-max", 'M');
+}
+
+lval* builtin_array_dot(lenv* e, lval* a) {
+    LASSERT_NUM("array-dot", a, 2);
+    LASSERT_TYPE("array-dot", a, 0, LVAL_ARR);
+    LASSERT_TYPE("array-dot", a, 1, LVAL_ARR);
+
+    larr* x = a->cell[0]->arr;
+    larr* y = a->cell[1]->arr;
+    LASSERT(a, (x->count == y->count),
+            "'array-dot' length mismatch, %li and %li", x->count, y->count);
+
+    lval* r = lval_num(larr_dot(x->data, y->data, x->count));
+    lval_del(a);
+    return r;
+}
+
+/* elementwise, either side may be a Number which is applied to every
+ * element of the other */
+lval* builtin_array_op(lenv* e, lval* a, char* func, char op) {
+    LASSERT_NUM(func, a, 2);
+    LASSERT(a, ((a->cell[0]->type == LVAL_ARR || a->cell[0]->type == LVAL_NUM) &&
+                (a->cell[1]->type == LVAL_ARR || a->cell[1]->type == LVAL_NUM) &&
+                (a->cell[0]->type == LVAL_ARR || a->cell[1]->type == LVAL_ARR)),
+            "'%s' expects two %ss or an %s and a %s, got %s and %s",
+            func, ltype_name(LVAL_ARR), ltype_name(LVAL_ARR), ltype_name(LVAL_NUM),
+            ltype_name(a->cell[0]->type), ltype_name(a->cell[1]->type));
+
+    long n = a->cell[0]->type == LVAL_ARR ? a->cell[0]->arr->count : a->cell[1]->arr->count;
+    if (a->cell[0]->type == LVAL_ARR && a->cell[1]->type == LVAL_ARR) {
+        LASSERT(a, (a->cell[1]->arr->count == n),
+                "'%s' length mismatch, %li and %li", func, n, a->cell[1]->arr->count);
+    }
+
+    long* xy[2];
+    larr* tmp[2] = {NULL, NULL};
+    for (int i = 0; i < 2; i++) {
+        if (a->cell[i]->type == LVAL_ARR) {
+            xy[i] = a->cell[i]->arr->data;
+        } else {
+            tmp[i] = larr_new(n);
+            for (long j = 0; j < n; j++) {
+                tmp[i]->data[j] = a->cell[i]->num;
+            }
+            xy[i] = tmp[i]->data;
+        }
+    }
+
+    larr* r = larr_new(n);
+    long* x = xy[0];
+    long* y = xy[1];
+    lval* err = NULL;
+    switch (op) {
+        case '+': arr_kernels.add(r->data, x, y, n); break;
+        case '-': arr_kernels.sub(r->data, x, y, n); break;
+        case '*':
+            for (long i = 0; i < n; i++) {
+                r->data[i] = (unsigned long)x[i] * y[i];
+            }
+            break;
+        case '/':
+            for (long i = 0; i < n && !err; i++) {
+                if (y[i] == 0) {
+                    err = lval_err_code(LERR_DIV_ZERO, func, 0, 0, 0);
+                } else {
+                    r->data[i] = x[i] / y[i];
+                }
+            }
+            break;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (tmp[i]) {
+            larr_del(tmp[i]);
+        }
+    }
+    lval_del(a);
+    if (err) {
+        larr_del(r);
+        return err;
+    }
+    return lval_arr(r);
+}
+
+lval* builtin_array_add(lenv* e, lval* a) {
+    return builtin_array_op(e, a, "array-add", '+');
+}
 
+lval* builtin_array_sub(lenv* e, lval* a) {
+    return builtin_array_op(e, a, "array-sub", '-');
+}
+
+lval* builtin_array_mul(lenv* e, lval* a) {
+    return builtin_array_op(e, a, "array-mul", '*');
+}
+
+lval* builtin_array_div(lenv* e, lval* a) {
+    return builtin_array_op(e, a, "array-div", '/');
+}
+
+/* vector builtins */
+
+lval* builtin_vec(lenv* e, lval* a) {
+    lvec* v = lvec_new(a->count);
     for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE("*", a, i, LVAL_NUM);
+        v->items[i] = a->cell[i];
     }
+    v->count = a->count;
+    a->count = 0;
+    lval_del(a);
 
-    lval* x = lval_pop(a, 0);
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-        x->num *= y->num;
-        lval_del(y);
+    return lval_vec(v, 0, v->count);
+}
+
+lval* builtin_vec_from(lenv* e, lval* a) {
+    LASSERT_NUM("vec-from", a, 1);
+    LFORCE(e, a, 0);
+    LASSERT_TYPE("vec-from", a, 0, LVAL_QEXPR);
+
+    lval* l = lval_take(a, 0);
+    l->type = LVAL_SEXPR;
+    l->hash = 0;
+    return builtin_vec(e, l);
+}
+
+lval* builtin_vec_make(lenv* e, lval* a) {
+    LASSERT_NUM("vec-make", a, 2);
+    LASSERT_TYPE("vec-make", a, 0, LVAL_NUM);
+    LASSERT(a, (a->cell[0]->num >= 0),
+            "'vec-make' passed negative length %li", a->cell[0]->num);
+
+    long n = a->cell[0]->num;
+    lvec* v = lvec_new(n);
+    for (long i = 0; i < n; i++) {
+        v->items[i] = lval_copy(a->cell[1]);
     }
+    v->count = n;
+
+    lval_del(a);
+    return lval_vec(v, 0, n);
+}
+
+lval* builtin_vec_list(lenv* e, lval* a) {
+    LASSERT_NUM("vec-list", a, 1);
+    LASSERT_TYPE("vec-list", a, 0, LVAL_VEC);
+
+    lval* v = a->cell[0];
+    long n = lval_vec_len(v);
+    lval* r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * (n ? n : 1));
+    for (long i = 0; i < n; i++) {
+        r->cell[r->count++] = lval_copy(v->vec->items[v->vec_off + i]);
+    }
+
+    lval_del(a);
+    return r;
+}
+
+lval* builtin_vec_get(lenv* e, lval* a) {
+    LASSERT_NUM("vec-get", a, 2);
+    LASSERT_TYPE("vec-get", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-get", a, 1, LVAL_NUM);
 
+    lval* v = a->cell[0];
+    long i = a->cell[1]->num;
+    LASSERT(a, (i >= 0 && i < lval_vec_len(v)),
+            "'vec-get' index %li out of range for vector of length %li",
+            i, lval_vec_len(v));
+
+    lval* x = lval_copy(v->vec->items[v->vec_off + i]);
     lval_del(a);
     return x;
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-    LASSERT_NUM_MIN("/", a, 2);
+/* writes through to the shared storage, so every copy & overlapping
+ * slice of the vector sees the new item */
+lval* builtin_vec_set(lenv* e, lval* a) {
+    LASSERT_NUM("vec-set", a, 3);
+    LASSERT_TYPE("vec-set", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-set", a, 1, LVAL_NUM);
+
+    lval* v = a->cell[0];
+    long i = a->cell[1]->num;
+    LASSERT(a, (i >= 0 && i < lval_vec_len(v)),
+            "'vec-set' index %li out of range for vector of length %li",
+            i, lval_vec_len(v));
+
+    lval* x = lval_pop(a, 2);
+    lval_del(v->vec->items[v->vec_off + i]);
+    v->vec->items[v->vec_off + i] = x;
+    return lval_take(a, 0);
+}
+
+/* appends in place when v's view ends where its storage does, the
+ * vectors sharing the storage keep their own lengths so they don't see
+ * the new item. Otherwise the viewed items are first copied into
+ * storage of their own */
+lval* builtin_vec_push(lenv* e, lval* a) {
+    LASSERT_NUM("vec-push", a, 2);
+    LASSERT_TYPE("vec-push", a, 0, LVAL_VEC);
+
+    lval* x = lval_pop(a, 1);
+    lval* v = lval_take(a, 0);
+    if (v->vec_off + v->vec_len != v->vec->count) {
+        long n = v->vec_len;
+        lvec* own = lvec_new(n + 1);
+        for (long i = 0; i < n; i++) {
+            own->items[i] = lval_copy(v->vec->items[v->vec_off + i]);
+        }
+        own->count = n;
+        lvec_del(v->vec);
+        v->vec = own;
+        v->vec_off = 0;
+    }
+
+    lvec_push(v->vec, x);
+    v->vec_len++;
+    return v;
+}
+
+lval* builtin_vec_slice(lenv* e, lval* a) {
+    LASSERT_NUM("vec-slice", a, 3);
+    LASSERT_TYPE("vec-slice", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vec-slice", a, 1, LVAL_NUM);
+    LASSERT_TYPE("vec-slice", a, 2, LVAL_NUM);
+
+    long n = lval_vec_len(a->cell[0]);
+    long lo = a->cell[1]->num;
+    long hi = a->cell[2]->num;
+    LASSERT(a, (0 <= lo && lo <= hi && hi <= n),
+            "'vec-slice' range %li to %li out of range for vector of length %li",
+            lo, hi, n);
+
+    lval* v = lval_take(a, 0);
+    v->vec_off += lo;
+    v->vec_len = hi - lo;
+    return v;
+}
+
+/* sequence builtins */
 
+lval* builtin_range(lenv* e, lval* a) {
+    LASSERT_NUM_MIN("range", a, 2);
+    LASSERT(a, (a->count <= 3),
+            "'range' too many arguments, expected at most 3, got %d", a->count);
     for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE("/", a, i, LVAL_NUM);
+        LASSERT_TYPE("range", a, i, LVAL_NUM);
     }
 
-    lval* x = lval_pop(a, 0);
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-        if (y->num == 0) {
-            lval_del(x);
-            lval_del(y);
-            lval_del(a);
-            return lval_err("division by zero");
-        }
-        x->num /= y->num;
-        lval_del(y);
+    lseq* s = lseq_new(LSEQ_RANGE, NULL, NULL);
+    s->cur = a->cell[0]->num;
+    s->end = a->cell[1]->num;
+    s->step = a->count == 3 ? a->cell[2]->num : 1;
+    if (s->step == 0) {
+        lseq_del(s);
+        lval_del(a);
+        return lval_err("'range' step must not be 0");
     }
 
     lval_del(a);
-    return x;
+    return lval_seq(s);
 }
 
-lval* builtin_bool(lenv* e, lval* a) {
-    LASSERT_NUM("bool", a, 1);
-    LASSERT_TYPE("bool", a, 0, LVAL_NUM);
+lval* builtin_lazy(lenv* e, lval* a) {
+    LASSERT_NUM("lazy", a, 1);
+    LASSERT_TYPE("lazy", a, 0, LVAL_QEXPR);
 
-    lval* x = lval_bool(a->cell[0]->num);
-    lval_del(a);
-    return x;
+    lseq* s = lseq_new(LSEQ_LIST, NULL, NULL);
+    s->list = lval_take(a, 0);
+    return lval_seq(s);
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-    LASSERT_NUM("<", a, 2);
-    LASSERT_TYPE("<", a, 0, LVAL_NUM);
-    LASSERT_TYPE("<", a, 1, LVAL_NUM);
+lval* builtin_collect(lenv* e, lval* a) {
+    LASSERT_NUM("collect", a, 1);
+    LFORCE(e, a, 0);
+    LASSERT_TYPE("collect", a, 0, LVAL_QEXPR);
 
-    int x = a->cell[0]->num;
-    int y = a->cell[1]->num;
-    lval_del(a);
-    return lval_bool(x < y);
+    return lval_take(a, 0);
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-    LASSERT_NUM(">", a, 2);
-    LASSERT_TYPE(">", a, 0, LVAL_NUM);
-    LASSERT_TYPE(">", a, 1, LVAL_NUM);
+/* wraps the sequence in a->cell[1] in a new stage; nothing is pulled
+ * until the result is consumed */
+lval* builtin_seq_stage(lenv* e, lval* a, char* func, int kind) {
+    if (kind == LSEQ_TAKE) {
+        LASSERT_TYPE(func, a, 0, LVAL_NUM);
+        LASSERT(a, (a->cell[0]->num >= 0),
+                "'%s' passed negative count %li", func, a->cell[0]->num);
+    } else {
+        LASSERT_TYPE(func, a, 0, LVAL_FUN);
+    }
 
-    int x = a->cell[0]->num;
-    int y = a->cell[1]->num;
-    lval_del(a);
-    return lval_bool(x > y);
-}
+    lval* src = lval_pop(a, 1);
+    lval* arg = lval_take(a, 0);
 
-lval* builtin_le(lenv* e, lval* a) {
-    LASSERT_NUM("<=", a, 2);
-    LASSERT_TYPE("<=", a, 0, LVAL_NUM);
-    LASSERT_TYPE("<=", a, 1, LVAL_NUM);
+    lseq* s;
+    if (kind == LSEQ_TAKE) {
+        s = lseq_new(kind, src->seq, NULL);
+        s->cur = arg->num;
+        lval_del(arg);
+    } else {
+        s = lseq_new(kind, src->seq, arg);
+    }
+    src->seq = NULL;
+    lval_del(src);
 
-    int x = a->cell[0]->num;
-    int y = a->cell[1]->num;
-    lval_del(a);
-    return lval_bool(x <= y);
+    return lval_seq(s);
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-    LASSERT_NUM(">=", a, 2);
-    LASSERT_TYPE(">=", a, 0, LVAL_NUM);
-    LASSERT_TYPE(">=", a, 1, LVAL_NUM);
+/* deal with builtins */
 
-    int x = a->cell[0]->num;
-    int y = a->cell[1]->num;
-    lval_del(a);
-    return lval_bool(x >= y);
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* k = lval_sym(name);
+    lval* v = lval_fun(func);
+    lenv_put(e, k, v);
+    lval_del(k);
+    lval_del(v);
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-    LASSERT_NUM("==", a, 2);
-    int r = lval_eq(a->cell[0], a->cell[1]);
-    lval_del(a);
-    return lval_bool(r);
+/* builtin descriptors: arity is exact, or the minimum for a variadic
+ * builtin. types and ret are only given where the builtin's own check
+ * is exactly that, LVAL_ERR (0) standing for any, the last entry of
+ * types covering the rest. fast is the same builtin without the arity
+ * and type checks, used at call sites lbuiltin_mark proved. pure ones
+ * never reach user code, so literal calls can be folded */
+lbuiltin_desc builtin_table[] = {
+    { "list",  builtin_list,  NULL, 0, 1, {0}, LVAL_QEXPR, 1 },
+    { "head",  builtin_head,  builtin_head_fast, 1, 0, {LVAL_QEXPR}, LVAL_QEXPR, 1 },
+    { "tail",  builtin_tail,  builtin_tail_fast, 1, 0, {LVAL_QEXPR}, 0, 1 },
+    { "init",  builtin_init,  NULL, 1, 0, {LVAL_QEXPR}, LVAL_QEXPR, 1 },
+    { "eval",  builtin_eval,  builtin_eval_fast, 1, 0, {LVAL_QEXPR}, 0, 0 },
+    { "join",  builtin_join,  NULL, 1, 1, {LVAL_QEXPR, LVAL_QEXPR, LVAL_QEXPR}, LVAL_QEXPR, 1 },
+    { "+",     builtin_add,   NULL, 2, 1, {LVAL_NUM, LVAL_NUM, LVAL_NUM}, LVAL_NUM, 1 },
+    { "-",     builtin_sub,   NULL, 1, 1, {LVAL_NUM, LVAL_NUM, LVAL_NUM}, LVAL_NUM, 1 },
+    { "*",     builtin_mul,   NULL, 2, 1, {LVAL_NUM, LVAL_NUM, LVAL_NUM}, LVAL_NUM, 1 },
+    { "/",     builtin_div,   NULL, 2, 1, {LVAL_NUM, LVAL_NUM, LVAL_NUM}, LVAL_NUM, 1 },
+    { "bool",  builtin_bool,  NULL, 1, 0, {LVAL_NUM}, LVAL_BOOL, 1 },
+    { ":",     builtin_the,   NULL, 2, 0, {0, LVAL_STR}, 0, 1 },
+    { "<",     builtin_lt,    NULL, 2, 0, {LVAL_NUM, LVAL_NUM}, LVAL_BOOL, 1 },
+    { ">",     builtin_gt,    NULL, 2, 0, {LVAL_NUM, LVAL_NUM}, LVAL_BOOL, 1 },
+    { "<=",    builtin_le,    NULL, 2, 0, {LVAL_NUM, LVAL_NUM}, LVAL_BOOL, 1 },
+    { ">=",    builtin_ge,    NULL, 2, 0, {LVAL_NUM, LVAL_NUM}, LVAL_BOOL, 1 },
+    { "==",    builtin_eq,    builtin_eq_fast, 2, 0, {0}, LVAL_BOOL, 1 },
+    { "!=",    builtin_ne,    builtin_ne_fast, 2, 0, {0}, LVAL_BOOL, 1 },
+    { "&&",    builtin_and,   builtin_and_fast, 2, 0, {LVAL_BOOL, LVAL_BOOL}, LVAL_BOOL, 1 },
+    { "||",    builtin_or,    builtin_or_fast, 2, 0, {LVAL_BOOL, LVAL_BOOL}, LVAL_BOOL, 1 },
+    { "!",     builtin_not,   builtin_not_fast, 1, 0, {LVAL_BOOL}, LVAL_BOOL, 1 },
+    { "if",    builtin_if,    builtin_if_fast, 3, 0, {LVAL_BOOL, LVAL_QEXPR, LVAL_QEXPR}, 0, 0 },
+    { "select", builtin_select, NULL, 0, 1 },
+    { "cond",   builtin_select, NULL, 0, 1 },
+    { "case",   builtin_case,   NULL, 1, 1 },
+    { "match",  builtin_match,  NULL, 1, 1 },
+    { "while", builtin_while, NULL, 2, 0 },
+    { "dotimes", builtin_dotimes, NULL, 3, 0 },
+    { "for",   builtin_for,   NULL, 4, 0 },
+    { "let",   builtin_let,   NULL, 1, 1 },
+    { "do",    builtin_do,    NULL, 0, 1 },
+    { "loop",  builtin_loop,  NULL, 2, 1 },
+    { "recur", builtin_recur, NULL, 0, 1 },
+    { "\\",    builtin_lambda, NULL, 2, 0 },
+    { "defmacro", builtin_defmacro, NULL, 2, 0 },
+    { "def",   builtin_def,   NULL, 1, 1 },
+    { "=",     builtin_put,   NULL, 1, 1 },
+    { "load",  builtin_load,  NULL, 1, 0 },
+    { "require", builtin_require, NULL, 1, 0 },
+    { "export",  builtin_export,  NULL, 1, 0 },
+    { "print", builtin_print, NULL, 0, 1 },
+    { "error", builtin_error, NULL, 1, 0 },
+    { "try",   builtin_try,   NULL, 2, 1 },
+
+    { "memo",       builtin_memo,       NULL, 1, 1 },
+    { "memo-stats", builtin_memo_stats, NULL, 1, 0 },
+
+    { "len",     builtin_len,     NULL, 1, 0 },
+    { "empty?",  builtin_empty,   NULL, 1, 0, {0}, LVAL_BOOL, 0 },
+    { "nth",     builtin_nth,     NULL, 2, 0 },
+    { "last",    builtin_last,    NULL, 1, 0 },
+    { "map",     builtin_map,     NULL, 2, 0 },
+    { "filter",  builtin_filter,  NULL, 2, 0 },
+    { "foldl",   builtin_foldl,   NULL, 3, 0 },
+    { "foldr",   builtin_foldr,   NULL, 3, 0 },
+    { "reverse", builtin_reverse, NULL, 1, 0 },
+    { "take",    builtin_take,    NULL, 2, 0 },
+    { "drop",    builtin_drop,    NULL, 2, 0 },
+    { "elem",    builtin_elem,    NULL, 2, 0 },
+    { "zip",     builtin_zip,     NULL, 2, 0 },
+    { "unzip",   builtin_unzip,   NULL, 1, 0 },
+    { "sum",     builtin_sum,     NULL, 1, 0 },
+    { "product", builtin_product, NULL, 1, 0 },
+    { "takewhile", builtin_takewhile, NULL, 2, 0 },
+
+    { "sort",    builtin_sort,    NULL, 1, 0 },
+    { "sort-by", builtin_sort_by, NULL, 2, 0 },
+
+    { "hash-map",   builtin_hash_map,     NULL, 0, 1 },
+    { "hash-get",   builtin_hash_get,     NULL, 2, 1 },
+    { "hash-has",   builtin_hash_has,     NULL, 2, 0 },
+    { "hash-put",   builtin_hash_put,     NULL, 3, 0 },
+    { "hash-put!",  builtin_hash_put_mut, NULL, 3, 0 },
+    { "hash-del",   builtin_hash_del,     NULL, 2, 0 },
+    { "hash-del!",  builtin_hash_del_mut, NULL, 2, 0 },
+    { "hash-keys",  builtin_hash_keys,    NULL, 1, 0 },
+    { "hash-vals",  builtin_hash_vals,    NULL, 1, 0 },
+    { "hash-items", builtin_hash_items,   NULL, 1, 0 },
+    { "hash-each",  builtin_hash_each,    NULL, 2, 0 },
+
+    { "array",         builtin_array,         NULL, 1, 0 },
+    { "array-list",    builtin_array_list,    NULL, 1, 0 },
+    { "array-range",   builtin_array_range,   NULL, 2, 0 },
+    { "array-get",     builtin_array_get,     NULL, 2, 0 },
+    { "array-sum",     builtin_array_sum,     NULL, 1, 0 },
+    { "array-product", builtin_array_product, NULL, 1, 0 },
+    { "array-min",     builtin_array_min,     NULL, 1, 0 },
+    { "array-max",     builtin_array_max,     NULL, 1, 0 },
+    { "array-dot",     builtin_array_dot,     NULL, 2, 0 },
+    { "array-add",     builtin_array_add,     NULL, 2, 0 },
+    { "array-sub",     builtin_array_sub,     NULL, 2, 0 },
+    { "array-mul",     builtin_array_mul,     NULL, 2, 0 },
+    { "array-div",     builtin_array_div,     NULL, 2, 0 },
+
+    { "vec",       builtin_vec,       NULL, 0, 1 },
+    { "vec-from",  builtin_vec_from,  NULL, 1, 0 },
+    { "vec-make",  builtin_vec_make,  NULL, 2, 0 },
+    { "vec-list",  builtin_vec_list,  NULL, 1, 0 },
+    { "vec-get",   builtin_vec_get,   NULL, 2, 0 },
+    { "vec-set",   builtin_vec_set,   NULL, 3, 0 },
+    { "vec-push",  builtin_vec_push,  NULL, 2, 0 },
+    { "vec-slice", builtin_vec_slice, NULL, 3, 0 },
+
+    { "range",   builtin_range,   NULL, 2, 1 },
+    { "lazy",    builtin_lazy,    NULL, 1, 0 },
+    { "collect", builtin_collect, NULL, 1, 0 },
+};
+
+/* the sequences BUGSP_PROFILE finds most often over bench.bsp that a
+ * fused path does better on, each its base builtin's entry plus that
+ * path. lbuiltin_fuse picks them for proven call sites */
+lbuiltin_desc fused_table[] = {
+    { "if",    builtin_if,    builtin_if_fast, 3, 0, {LVAL_BOOL, LVAL_QEXPR, LVAL_QEXPR}, 0, 0, lfuse_if },
+    { "eval",  builtin_eval,  builtin_eval_fast, 1, 0, {LVAL_QEXPR}, 0, 0, lfuse_eval_head },
+    { "case",  builtin_case,  NULL, 1, 1, {0}, 0, 0, lfuse_case },
+};
+
+unsigned long lbuiltin_name_hash(char* name) {
+    unsigned long h = 0xcbf29ce484222325UL;
+    for (char* c = name; *c; c++) {
+        h = (h ^ (unsigned char)*c) * 0x100000001b3UL;
+    }
+    return h;
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-    LASSERT_NUM("!=", a, 2);
-    int r = !lval_eq(a->cell[0], a->cell[1]);
-    lval_del(a);
-    return lval_bool(r);
+/* the descriptor of the builtin named name, NULL if there's none. Every
+ * binding asks, so the names are hashed into slots on first use */
+lbuiltin_desc* lbuiltin_named(char* name) {
+    static lbuiltin_desc* slots[LBUILTIN_SLOTS];
+    static int ready;
+    if (!ready) {
+        int n = sizeof(builtin_table) / sizeof(builtin_table[0]);
+        for (int i = 0; i < n; i++) {
+            long j = lbuiltin_name_hash(builtin_table[i].name) & (LBUILTIN_SLOTS - 1);
+            while (slots[j]) {
+                j = (j + 1) & (LBUILTIN_SLOTS - 1);
+            }
+            slots[j] = &builtin_table[i];
+        }
+        ready = 1;
+    }
+
+    long j = lbuiltin_name_hash(name) & (LBUILTIN_SLOTS - 1);
+    for (; slots[j]; j = (j + 1) & (LBUILTIN_SLOTS - 1)) {
+        if (strcmp(slots[j]->name, name) == 0) {
+            return slots[j];
+        }
+    }
+    return NULL;
 }
 
-lval* builtin_and(lenv* e, lval* a) {
-    LASSERT_NUM("&&", a, 2);
-    LASSERT_TYPE("&&", a, 0, LVAL_BOOL);
-    LASSERT_TYPE("&&", a, 1, LVAL_BOOL);
+/* notes k being bound to v, NULL when the value isn't known yet, and
+ * gives up on proven call sites if that rebinds a builtin's name */
+/* whether binding d's name to v shadows d, v NULL for no binding */
+int lbuiltin_shadows(lbuiltin_desc* d, lval* v) {
+    return v && !(v->type == LVAL_FUN && v->builtin == d->fn);
+}
 
-    int r = (a->cell[0]->num == 1 && a->cell[1]->num == 1);
-    lval_del(a);
-    return lval_bool(r);
+/* counts the binding of sym going from old to v, either NULL when
+ * there's no binding, in or out of the shadows on sym's builtin */
+void lbuiltin_shadow(char* sym, lval* old, lval* v) {
+    lbuiltin_desc* d = lbuiltin_named(sym);
+    if (d) {
+        int by = lbuiltin_shadows(d, v) - lbuiltin_shadows(d, old);
+        d->shadows += by;
+        builtins_shadowed += by;
+    }
 }
 
-lval* builtin_or(lenv* e, lval* a) {
-    LASSERT_NUM("||", a, 2);
-    LASSERT_TYPE("||", a, 0, LVAL_BOOL);
-    LASSERT_TYPE("||", a, 1, LVAL_BOOL);
+/* the type x is sure to evaluate to, if it evaluates at all, else 0 */
+int lbuiltin_type(lenv* e, lval* x) {
+    switch (x->type) {
+        case LVAL_NUM:
+        case LVAL_BOOL:
+        case LVAL_STR:
+        case LVAL_QEXPR:
+            return x->type;
+        case LVAL_SEXPR:
+            if (x->count >= 2) {
+                lbuiltin fn = lval_head_builtin(e, x);
+                lbuiltin_desc* d = fn ? lbuiltin_find(fn) : NULL;
+                return d ? d->ret : 0;
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
 
-    int r = (a->cell[0]->num == 1 || a->cell[1]->num == 1);
-    lval_del(a);
-    return lval_bool(r);
+/* the descriptor of the builtin v calls when v's arity and the types of
+ * its arguments are known to fit it, NULL otherwise */
+lbuiltin_desc* lbuiltin_site(lenv* e, lval* v) {
+    lbuiltin fn = v->count >= 2 ? lval_head_builtin(e, v) : NULL;
+    if (fn == NULL || (builtins_shadowed && !lval_proven_holds(v))) {
+        return NULL;
+    }
+    lbuiltin_desc* d = lbuiltin_find(fn);
+    int n = v->count - 1;
+    if (d == NULL || (d->variadic ? n < d->arity : n != d->arity)) {
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        int t = d->types[i < 2 ? i : 2];
+        if (t && lbuiltin_type(e, v->cell[i + 1]) != t) {
+            return NULL;
+        }
+    }
+    return lbuiltin_fuse(e, v, d);
 }
 
-lval* builtin_not(lenv* e, lval* a) {
-    LASSERT_NUM("!", a, 1);
-    LASSERT_TYPE("!", a, 0, LVAL_BOOL);
+/* (if (== x {...}) ...), likewise with != or (empty? x), tested on the
+ * list x is bound to rather than on a copy of it */
+lval* lfuse_if(lenv* e, lval* v) {
+    lval* c = v->cell[1];
+    lbuiltin test = lval_head_builtin(e, c);
+    if (lval_head_builtin(e, v) != builtin_if) {
+        return NULL;
+    }
 
     int r;
-    if (a->cell[0]->num == 1) {
-        r = 0;
+    if (test == builtin_empty) {
+        lval* x = lenv_find(e, c->cell[1]);
+        if (x == NULL || x->type != LVAL_QEXPR) {
+            return NULL;
+        }
+        r = x->count == 0;
+    } else if (test == builtin_eq || test == builtin_ne) {
+        int i = c->cell[1]->type == LVAL_SYM ? 1 : 2;
+        lval* x = lenv_find(e, c->cell[i]);
+        if (x == NULL || x->type == LVAL_SEQ) {
+            return NULL;
+        }
+        r = lval_eq(x, c->cell[3 - i]) == (test == builtin_eq);
     } else {
-        r = 1;
+        return NULL;
     }
-    lval_del(a);
-    return lval_bool(r);
-}
 
-lval* builtin_if(lenv* e, lval* a) {
-    LASSERT_NUM("if", a, 3);
-    LASSERT_TYPE("if", a, 0, LVAL_BOOL);
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+    /* the branch may be an interned literal, so own it before retagging */
+    lval* b = lval_own(lval_take(v, r ? 2 : 3));
+    b->type = LVAL_SEXPR;
+    b->hash = 0;
+    return lval_eval(e, b);
+}
 
-    lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+/* (case x {key value} ...) with literal keys, looking x up in the table
+ * lcase_attach built instead of trying each key. v is left as it was so
+ * a lambda body can run straight off it, NULL if v doesn't call case */
+lval* lcase_value(lenv* e, lval* v) {
+    if (v->cases == NULL || lval_head_builtin(e, v) != builtin_case) {
+        return NULL;
+    }
 
-    if (a->cell[0]->num) {
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        x = lval_eval(e, lval_pop(a, 2));
+    lval* x = lval_eval(e, lval_copy(v->cell[1]));
+    if (x->type == LVAL_ERR) {
+        return x;
     }
+    /* clause i is v->cell[i + 1] */
+    int hit = lcase_find(v->cases, v->cell + 1, x);
+    lval_del(x);
+    return hit < 0 ? lval_err("No case found") : lval_item(e, v->cell[hit + 1], 1);
+}
 
-    lval_del(a);
+lval* lfuse_case(lenv* e, lval* v) {
+    lval* x = lcase_value(e, v);
+    if (x) {
+        lval_del(v);
+    }
     return x;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-    LASSERT_NUM("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
-
-    for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-                "cannot define non-symbol (%s)", ltype_name(a->cell[0]->cell[i]->type));
+/* (eval (head x)), as fst does, copying only the item it evaluates */
+lval* lfuse_eval_head(lenv* e, lval* v) {
+    lval* c = v->cell[1];
+    if (lval_head_builtin(e, v) != builtin_eval ||
+        lval_head_builtin(e, c) != builtin_head) {
+        return NULL;
+    }
+    lval* x = lenv_find(e, c->cell[1]);
+    if (x == NULL || x->type != LVAL_QEXPR || x->count == 0) {
+        return NULL;
     }
 
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
-
-    return lval_lambda(formals, body);
+    lval* y = lval_add(lval_sexpr(), lval_copy(x->cell[0]));
+    lval_del(v);
+    return lval_eval(e, y);
 }
 
-lval* builtin_var(lenv* e, lval* a, char* func) {
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+/* the fused entry covering v when it's one of the shapes fused_table
+ * is for, else its proven site d */
+lbuiltin_desc* lbuiltin_fuse(lenv* e, lval* v, lbuiltin_desc* d) {
+    if (d && d->fn == builtin_case && v->count - 2 >= CASE_TABLE_MIN &&
+        lcase_literal(v->cell + 1, v->count - 2)) {
+        return &fused_table[2];
+    }
+    if (d == NULL || v->cell[1]->type != LVAL_SEXPR) {
+        return d;
+    }
+    lval* c = v->cell[1];
+    lbuiltin test = c->count >= 2 ? lval_head_builtin(e, c) : NULL;
 
-    lval* syms = a->cell[0];
-    for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-                "'%s' cannot define non-symbol (%s)",
-                func, ltype_name(syms->cell[i]->type));
+    if (d->fn == builtin_if && v->cell[2]->type == LVAL_QEXPR &&
+        v->cell[3]->type == LVAL_QEXPR) {
+        if (test == builtin_empty && c->count == 2 && c->cell[1]->type == LVAL_SYM) {
+            return &fused_table[0];
+        }
+        /* only against a list, as copying a number costs next to nothing */
+        if ((test == builtin_eq || test == builtin_ne) && c->count == 3) {
+            int a = c->cell[1]->type;
+            int b = c->cell[2]->type;
+            if ((a == LVAL_SYM && b == LVAL_QEXPR) || (a == LVAL_QEXPR && b == LVAL_SYM)) {
+                return &fused_table[0];
+            }
+        }
+    }
+    if (d->fn == builtin_eval && test == builtin_head && c->count == 2 &&
+        c->cell[1]->type == LVAL_SYM) {
+        return &fused_table[1];
     }
+    return d;
+}
 
-    LASSERT(a, (syms->count == a->count - 1),
-            "'%s' passed too many arguments for symbols", func);
+/* marks the proven call sites in a lambda body. With fold, calls of
+ * pure builtins on literals are replaced by their value, which is only
+ * done outside of Q-Expressions as those may be data */
+void lbuiltin_mark(lenv* e, lval* v, int fold) {
+    if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+        return;
+    }
+    fold = fold && v->type == LVAL_SEXPR;
 
-    for (int i = 0; i < syms->count; i++) {
-        if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i + 1]);
+    for (int i = 0; i < v->count; i++) {
+        lval* x = v->cell[i];
+        lbuiltin_mark(e, x, fold);
+        if (!fold || x->type != LVAL_SEXPR || x->site == NULL || !x->site->pure) {
+            continue;
         }
-        if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i + 1]);
+
+        int literal = 1;
+        for (int j = 1; j < x->count; j++) {
+            int t = x->cell[j]->type;
+            literal = literal && t != LVAL_SYM && t != LVAL_SEXPR;
+        }
+        if (!literal) {
+            continue;
+        }
+        lval* a = lval_sexpr();
+        for (int j = 1; j < x->count; j++) {
+            a = lval_add(a, lval_copy(x->cell[j]));
+        }
+        lval* r = x->site->fn(e, lval_own_cells(a));
+        if (r->type == LVAL_ERR) {
+            lval_del(r);
+        } else {
+            lval_del(x);
+            v->cell[i] = r;
         }
     }
 
-    lval_del(a);
-    return lval_sexpr();
-}
-
-lval* builtin_def(lenv* e, lval* a) {
-    return builtin_var(e, a, "def");
+    if (v->type == LVAL_SEXPR && v->site == NULL) {
+        v->site = lbuiltin_site(e, v);
+        lcase_attach(v);
+    }
+    for (int i = 2; i < v->count; i++) {
+        if (v->cell[i]->site == NULL && lval_is_branch(e, v, i)) {
+            v->cell[i]->site = lbuiltin_site(e, v->cell[i]);
+            lcase_attach(v->cell[i]);
+        }
+    }
 }
 
-lval* builtin_put(lenv* e, lval* a) {
-    return builtin_var(e, a, "=");
+/* builds the table of v if it's a case call lbuiltin_fuse picked */
+void lcase_attach(lval* v) {
+    if (v->site && v->site->fused == lfuse_case && v->cases == NULL) {
+        v->cases = lcase_new(v->cell + 1, v->count - 2);
+    }
 }
 
-lval* builtin_load(lenv* e, lval* a) {
-    LASSERT_NUM("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
-
-    mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Bugsp, &r)) {
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
-
-        while (expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
-            if (x->type == LVAL_ERR) {
-                lval_println(x);
-            }
-            lval_del(x);
+/* the descriptor of the builtin fn, NULL if it has none */
+lbuiltin_desc* lbuiltin_find(lbuiltin fn) {
+    int n = sizeof(builtin_table) / sizeof(builtin_table[0]);
+    for (int i = 0; i < n; i++) {
+        if (builtin_table[i].fn == fn) {
+            return &builtin_table[i];
         }
+    }
+    return NULL;
+}
 
-        lval_del(expr);
-        lval_del(a);
+void lenv_add_builtins(lenv* e) {
+    int n = sizeof(builtin_table) / sizeof(builtin_table[0]);
+    for (int i = 0; i < n; i++) {
+        lenv_add_builtin(e, builtin_table[i].name, builtin_table[i].fn);
+    }
+}
 
-        return lval_sexpr();
-    } else {
-        /* parser error */
-        char* err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+/* profiling */
 
-        lval* err = lval_err("Could not load library %s", err_msg);
-        free(err_msg);
-        lval_del(a);
+/* the op v calls, going by what its head is bound to now */
+int lprof_op(lenv* e, lval* v) {
+    lval* f = v->cell[0];
+    if (f->type == LVAL_SYM) {
+        f = lenv_find(e, f);
+    }
+    if (f == NULL || f->type != LVAL_FUN) {
+        return LPROF_OTHER;
+    }
+    if (f->builtin == NULL) {
+        return LPROF_LAMBDA;
+    }
+    lbuiltin_desc* d = lbuiltin_find(f->builtin);
+    return d ? (int)(d - builtin_table) : LPROF_OTHER;
+}
 
-        return err;
+char* lprof_name(int op) {
+    switch (op) {
+        case LPROF_TOPLEVEL: return "top";
+        case LPROF_LAMBDA: return "lambda";
+        case LPROF_OTHER: return "?";
     }
+    return builtin_table[op].name;
 }
 
-lval* builtin_print(lenv* e, lval* a) {
-    for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]);
-        putchar(' ');
+/* counts the n ops in t, which stops taking new sequences once full */
+void lprof_count(lprof_entry* t, int* ops, int n) {
+    unsigned long h = 0;
+    for (int i = 0; i < n; i++) {
+        h = (h + ops[i] + 3) * 0x9e3779b1UL;
+    }
+    for (int i = 0; i < LPROF_SLOTS; i++) {
+        lprof_entry* x = &t[(h + i) & (LPROF_SLOTS - 1)];
+        if (x->count == 0) {
+            memcpy(x->ops, ops, sizeof(int) * n);
+            x->count = 1;
+            return;
+        }
+        if (memcmp(x->ops, ops, sizeof(int) * n) == 0) {
+            x->count++;
+            return;
+        }
     }
+}
 
-    putchar('\n');
-    lval_del(a);
+/* lval_eval_sexpr counting v's op under the two it's nested in. Ops
+ * inside a native tree or a fused path run as one, so only the
+ * outermost is counted */
+lval* lprof_eval_sexpr(lenv* e, lval* v) {
+    lprof_table* p = &profile;
+    if (v->count < 2 || p->depth == LPROF_DEPTH) {
+        return lval_eval_sexpr(e, v);
+    }
 
-    return lval_sexpr();
+    int ops[3];
+    ops[0] = p->depth > 1 ? p->stack[p->depth - 2] : LPROF_TOPLEVEL;
+    ops[1] = p->depth > 0 ? p->stack[p->depth - 1] : LPROF_TOPLEVEL;
+    ops[2] = lprof_op(e, v);
+    lprof_count(p->pairs, &ops[1], 2);
+    lprof_count(p->triples, ops, 3);
+
+    p->stack[p->depth++] = ops[2];
+    lval* r = lval_eval_sexpr(e, v);
+    p->depth--;
+    return r;
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-    LASSERT_NUM("error", a, 1);
-    LASSERT_TYPE("error", a, 0, LVAL_STR);
-
-    lval* err = lval_err(a->cell[0]->str);
-    lval_del(a);
-    return err;
+/* most frequent first */
+int lprof_cmp(const void* x, const void* y) {
+    long a = ((lprof_entry*)x)->count;
+    long b = ((lprof_entry*)y)->count;
+    return (a < b) - (a > b);
 }
 
-/* deal with builtins */
+void lprof_print(char* title, lprof_entry* t, int n) {
+    lprof_entry* xs = malloc(sizeof(lprof_entry) * LPROF_SLOTS);
+    memcpy(xs, t, sizeof(lprof_entry) * LPROF_SLOTS);
+    qsort(xs, LPROF_SLOTS, sizeof(lprof_entry), lprof_cmp);
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(func);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
+    printf("%s\n", title);
+    for (int i = 0; i < LPROF_TOP && xs[i].count; i++) {
+        printf("%12ld ", xs[i].count);
+        for (int j = 0; j < n; j++) {
+            printf(" %s", lprof_name(xs[i].ops[j]));
+        }
+        putchar('\n');
+    }
+    free(xs);
 }
 
-void lenv_add_builtins(lenv* e) {
-    lenv_add_builtin(e, "list",  builtin_list);
-    lenv_add_builtin(e, "head",  builtin_head);
-    lenv_add_builtin(e, "tail",  builtin_tail);
-    lenv_add_builtin(e, "init",  builtin_init);
-    lenv_add_builtin(e, "eval",  builtin_eval);
-    lenv_add_builtin(e, "join",  builtin_join);
-    lenv_add_builtin(e, "+",     builtin_add);
-    lenv_add_builtin(e, "-",     builtin_sub);
-    lenv_add_builtin(e, "*",     builtin_mul);
-    lenv_add_builtin(e, "/",     builtin_div);
-    lenv_add_builtin(e, "bool",  builtin_bool);
-    lenv_add_builtin(e, "<",     builtin_lt);
-    lenv_add_builtin(e, ">",     builtin_gt);
-    lenv_add_builtin(e, "<=",    builtin_le);
-    lenv_add_builtin(e, ">=",    builtin_ge);
-    lenv_add_builtin(e, "==",    builtin_eq);
-    lenv_add_builtin(e, "!=",    builtin_ne);
-    lenv_add_builtin(e, "&&",    builtin_and);
-    lenv_add_builtin(e, "||",    builtin_or);
-    lenv_add_builtin(e, "!",     builtin_not);
-    lenv_add_builtin(e, "if",    builtin_if);
-    lenv_add_builtin(e, "\\",    builtin_lambda);
-    lenv_add_builtin(e, "def",   builtin_def);
-    lenv_add_builtin(e, "=",     builtin_put);
-    lenv_add_builtin(e, "load",  builtin_load);
-    lenv_add_builtin(e, "print", builtin_print);
-    lenv_add_builtin(e, "error", builtin_error);
+/* the sequences that ran most, each op nested in the one before it */
+void lprof_report(void) {
+    if (!profile.enabled) {
+        return;
+    }
+    lprof_print("profile: pairs", profile.pairs, 2);
+    lprof_print("profile: triples", profile.triples, 3);
 }
 
 /* main */
@@ -991,7 +6164,7 @@ int main(int argc, char**argv) {
     mpca_lang(MPC_LANG_DEFAULT,
         "                                                 \
             number  : /-?[0-9]+/ ;                        \
-            symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&|]+/ ; \
+            symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&|?:]+/ ; \
             string  : /\"(\\\\.|[^\"])*\"/ ;              \
             comment : /;[^\\r\\n]*/ ;                     \
             sexpr   : '(' <expr>* ')' ;                   \
@@ -1005,6 +6178,10 @@ int main(int argc, char**argv) {
     puts("Bugsp version 0.0.1");
     puts("Type 'quit' to exit\n");
 
+    larr_init_kernels();
+    intern_table.enabled = getenv("BUGSP_INTERN") != NULL;
+    profile.enabled = getenv("BUGSP_PROFILE") != NULL;
+
     lenv* e = lenv_new();
     lenv_add_builtins(e);
 
@@ -1042,7 +6219,7 @@ int main(int argc, char**argv) {
 
         mpc_result_t r;
         if (mpc_parse("<stdin>", input, Bugsp, &r)) {
-            lval* x = lval_eval(e, lval_read(r.output));
+            lval* x = lval_eval(e, lval_expand(e, lval_read(r.output), NULL));
             lval_println(x);
             lval_del(x);
             mpc_ast_delete(r.output);
@@ -1053,6 +6230,7 @@ int main(int argc, char**argv) {
 
         free(input);
     }
+    lprof_report();
     printf("Bye!\n");
 
     lenv_del(e);
@@ -3,6 +3,10 @@
 
 #define ERROR_BUFFER_LEN 512
 #define STDLIB_PATH "stdlib.bsp"
+#define SORT_PARALLEL_MIN 65536
+#define SORT_MAX_THREADS 8
+#define MAP_BITS 5
+#define CASE_TABLE_MIN 4
 
 #define LASSERT(args, cond, fmt, ...)             \
     if (!(cond)) {                                \
@@ -13,35 +17,57 @@
 
 #define LASSERT_NUM(func, args, exp)                                            \
     if (args->count != exp) {                                                   \
-        lval* err = lval_err(                                                   \
-            "'%s' incorrect number of arguments received, expected %d, got %d", \
-            func, exp, args->count);                                            \
+        lval* err = lval_err_code(LERR_ARGS, func, exp, args->count, 0);        \
         lval_del(args);                                                         \
         return err;                                                             \
     }
 
 #define LASSERT_NUM_MIN(func, args, exp)                      \
     if (args->count < exp) {                                  \
-        lval* err = lval_err(                                 \
-            "'%s' not enough arguments, expected %d, got %d", \
-            func, exp, args->count);                          \
+        lval* err = lval_err_code(LERR_ARGS_MIN, func,        \
+                                  exp, args->count, 0);       \
         lval_del(args);                                       \
         return err;                                           \
     }
 
+#define LFORCE(env, args, i)                              \
+    if (args->cell[i]->type == LVAL_SEQ) {                \
+        args->cell[i] = lval_force(env, args->cell[i]);   \
+        if (args->cell[i]->type == LVAL_ERR) {            \
+            return lval_take(args, i);                    \
+        }                                                 \
+    }
+
 #define LASSERT_TYPE(func, args, i, exp)                             \
     if (args->cell[i]->type != exp) {                                \
-        lval* err = lval_err(                                        \
-            "'%s' incorrect type for arg %d, expected %s, got %s",   \
-            func, i, ltype_name(exp), ltype_name(a->cell[i]->type)); \
+        lval* err = lval_err_code(LERR_TYPE, func,                   \
+                                  i, exp, args->cell[i]->type);      \
         lval_del(args);                                              \
         return err;                                                  \
     }
 
 struct lval;
 struct lenv;
+struct lseq;
+struct lmap;
+struct lmap_node;
+struct larr;
+struct lvec;
+struct lmemo;
+struct lfun;
+struct lnum;
+struct lcase;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lseq lseq;
+typedef struct lmap lmap;
+typedef struct lmap_node lmap_node;
+typedef struct larr larr;
+typedef struct lvec lvec;
+typedef struct lmemo lmemo;
+typedef struct lfun lfun;
+typedef struct lnum lnum;
+typedef struct lcase lcase;
 
 /* lval types & structures */
 
@@ -53,38 +79,422 @@ enum {
     LVAL_STR,
     LVAL_FUN,
     LVAL_SEXPR,
-    LVAL_QEXPR
+    LVAL_QEXPR,
+    LVAL_RECUR,
+    LVAL_SEQ,
+    LVAL_MAP,
+    LVAL_ARR,
+    LVAL_VEC
 };
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/* a builtin's entry in builtin_table, see lenv_add_builtins. Names are
+ * also hashed into LBUILTIN_SLOTS slots, which must exceed the entries */
+
+#define LBUILTIN_SLOTS 512
+
+typedef struct {
+    char* name;
+    lbuiltin fn;
+    lbuiltin fast;
+    int arity;
+    int variadic;
+    int types[3];
+    int ret;
+    int pure;
+    /* given on the entries of fused_table, runs the whole call before
+     * its cells are evaluated. NULL when the call isn't one it covers */
+    lbuiltin fused;
+    /* how many live bindings of the name are to something else, only
+     * kept on builtin_table's entries */
+    int shadows;
+} lbuiltin_desc;
+
 struct lval {
     int type;
 
     long num;
     char* err;
+    int err_code;
+    char* err_func;
+    long err_arg[3];
     char* sym;
     char* str;
 
     lbuiltin builtin;
-    lenv* env;
+    lfun* fun;
+    lmemo* memo;
+    /* a lambda whose body is a template, expanded in place of its calls */
+    int macro;
+
+    int count;
+    lval** cell;
+
+    lseq* seq;
+    lmap* map;
+    larr* arr;
+
+    /* a vector is a view of vec_len items from vec_off, so items
+     * pushed onto the shared storage by another view aren't in it */
+    lvec* vec;
+    long vec_off;
+    long vec_len;
+
+    /* cached by lval_hash for strings & lists, must be zeroed whenever
+     * a list's cells or type change */
+    unsigned long hash;
+
+    /* set on hash-consed literals, which are shared by every copy and
+     * never freed, see lval_own */
+    int interned;
+
+    /* arithmetic compiled by lnum_attach, shared by every copy and
+     * dropped as soon as the cells change */
+    lnum* native;
+    /* the builtin this call was proven to fit by lbuiltin_mark */
+    lbuiltin_desc* site;
+    /* the dispatch table lbuiltin_mark built for this case call, shared
+     * by every copy and dropped along with site */
+    lcase* cases;
+};
+
+/* lambdas: formals & body are shared by every copy, a partial
+ * application only adds its bound arguments in cell */
+
+struct lfun {
+    int refs;
     lval* formals;
     lval* body;
+    /* namespace of the module the lambda was made in, if any */
+    lenv* module;
+    /* set by def when the body is {if c {base} {join x (self ...)}},
+     * trmc is the index of the recursive branch, see lval_trmc */
+    int trmc;
+    lval* self;
+};
+
+/* native arithmetic trees: kid i of an op node stands for cell i + 1
+ * of the S-Expression it was compiled from, so it's run alongside the
+ * copy being evaluated and only leaves that aren't numbers or symbols
+ * are evaluated as lvals */
+
+enum {
+    LNUM_CONST,
+    LNUM_SYM,
+    LNUM_EXPR,
+    LNUM_THE,
+    LNUM_ADD,
+    LNUM_SUB,
+    LNUM_MUL,
+    LNUM_DIV,
+    LNUM_LT,
+    LNUM_GT,
+    LNUM_LE,
+    LNUM_GE
+};
+
+#define LNUM_MAX_ARGS 8
+
+/* a readonly tree has only numbers and symbols for leaves, so running
+ * it leaves the S-Expression as it was and needs no copy */
 
+struct lnum {
+    int refs;
+    int op;
+    char* name;
+    int readonly;
     int count;
-    lval** cell;
+    struct lnum** kids;
 };
 
+/* error codes: everything but LERR_MSG keeps its raw arguments and is
+ * only formatted into err by lval_err_msg when it's printed or compared */
+
+enum {
+    LERR_MSG,
+    LERR_ARGS,
+    LERR_ARGS_MIN,
+    LERR_TYPE,
+    LERR_UNBOUND,
+    LERR_DIV_ZERO,
+    LERR_USER
+};
+
+/* lazy sequences: a chain of stages, each pulling from its src */
+
+enum {
+    LSEQ_RANGE,
+    LSEQ_LIST,
+    LSEQ_MAP,
+    LSEQ_FILTER,
+    LSEQ_TAKE,
+    LSEQ_TAKEWHILE
+};
+
+struct lseq {
+    int kind;
+
+    long cur;
+    long end;
+    long step;
+
+    lval* list;
+    lval* fn;
+    lseq* src;
+    int done;
+};
+
+/* sort entries: ints are sorted on key, anything else on k */
+
+typedef struct {
+    unsigned long key;
+    lval* k;
+    lval* v;
+} lsort_item;
+
+typedef struct {
+    lsort_item* items;
+    lsort_item* tmp;
+    long lo;
+    long mid;
+    long hi;
+    int ints;
+} lsort_job;
+
+/* hash maps: persistent hash array mapped tries, each level indexed by
+ * MAP_BITS more bits of the key's hash. Copies share the map, and a
+ * copy-on-write put gives itself a new map sharing the old one's nodes,
+ * copying only those on the path down to the key.
+ *
+ * A node is a leaf when key is set, a collision node holding leaves of
+ * equal hash when bitmap is 0, otherwise a branch with a kid for each
+ * bit set in bitmap */
+
+struct lmap_node {
+    int refs;
+    unsigned int bitmap;
+    int count;
+    unsigned long hash;
+    lval* key;
+    lval* val;
+    lmap_node** kids;
+};
+
+struct lmap {
+    int refs;
+    long count;
+    lmap_node* root;
+};
+
+/* dense numeric arrays, immutable so copies can share the data */
+
+struct larr {
+    int refs;
+    long count;
+    long* data;
+};
+
+/* growable vector storage, shared by every copy & slice of a vector */
+
+struct lvec {
+    int refs;
+    long count;
+    long cap;
+    lval** items;
+};
+
+/* memo caches: chained buckets keyed on the argument list, with the
+ * entries also kept on a most recently used first list for eviction */
+
+typedef struct lmemo_entry {
+    unsigned long hash;
+    lval* args;
+    lval* val;
+    struct lmemo_entry* chain;
+    struct lmemo_entry* prev;
+    struct lmemo_entry* next;
+} lmemo_entry;
+
+struct lmemo {
+    int refs;
+    lval* fn;
+    long cap;
+    long count;
+    long nbuckets;
+    lmemo_entry** buckets;
+    lmemo_entry* head;
+    lmemo_entry* tail;
+    long hits;
+    long misses;
+    long evictions;
+};
+
+/* array kernels, the widest the cpu supports is picked at startup */
+
+typedef struct {
+    char* name;
+    long (*sum)(const long* x, long n);
+    long (*min)(const long* x, long n);
+    long (*max)(const long* x, long n);
+    void (*add)(long* r, const long* x, const long* y, long n);
+    void (*sub)(long* r, const long* x, const long* y, long n);
+} larr_kernels;
+
+/* hash-consing of quoted literals, on when BUGSP_INTERN is set */
+
+typedef struct {
+    int enabled;
+    long count;
+    long cap;
+    lval** items;
+} lintern_table;
+
 struct lenv {
     lenv* parent;
     int count;
     char** syms;
     lval** vals;
+
+    /* set on a module's namespace, which is where def stops; exports
+     * lists what require copies out, NULL for everything */
+    int namespace;
+    lval* exports;
+
+    /* on call frames of a module's lambdas, the module's namespace,
+     * searched right after the frame itself */
+    lenv* module;
+};
+
+/* the formals of the lambdas a form is inside while it's expanded,
+ * innermost first, as calls through them are never macro calls */
+
+typedef struct lscope {
+    lval* formals;
+    struct lscope* up;
+} lscope;
+
+/* compiled case dispatch: for a case call in a lambda body whose keys
+ * are all literals, a table from key hash to clause number. It's built
+ * once when the body is analysed, the keys can't change after that */
+
+struct lcase {
+    int refs;
+    long cap;
+    unsigned long* keys;
+    int* idx;
 };
 
+/* compiled match patterns: each clause is a run of ops, a list node's
+ * shape check always comes before the ops on its items so their paths
+ * can be followed through cell[], or a vector's items, without further
+ * checks */
+
+enum {
+    LMATCH_LEN,
+    LMATCH_MIN,
+    LMATCH_EQ,
+    LMATCH_BIND,
+    LMATCH_REST
+};
+
+typedef struct {
+    int kind;
+    int depth;
+    int* path;
+    long n;
+    lval* x;
+} lmatch_op;
+
+#define MATCH_CACHE_SIZE 256
+
+typedef struct {
+    unsigned long hash;
+    lval* src;
+    int count;
+    int* first;
+    int nops;
+    lmatch_op* ops;
+} lmatch;
+
+/* cached like case tables, one per slot with the patterns they came
+ * from */
+
+typedef struct {
+    lmatch* slots[MATCH_CACHE_SIZE];
+} lmatch_table;
+
+/* modules loaded by require, keyed on canonical path */
+
+typedef struct {
+    char* path;
+    long mtime;
+    lenv* env;
+} lmodule;
+
+typedef struct {
+    int count;
+    lmodule* items;
+} lmodule_table;
+
+/* analysed forms of code passed to eval, one per slot, keyed on the
+ * shape of the code so the same call with new data reuses the slot */
+
+#define EVAL_CACHE_SIZE 256
+#define EVAL_CACHE_NODES 256
+
+typedef struct {
+    unsigned long shape;
+    lval* form;
+    int marked;
+} leval_slot;
+
+typedef struct {
+    leval_slot slots[EVAL_CACHE_SIZE];
+    long hits;
+    long misses;
+} leval_cache;
+
+/* freed lvals kept for reuse, as most of them only live for one call.
+ * The pool is bounded so a burst of garbage still goes back to malloc.
+ * There's one, free_lvals, and it isn't locked */
+
+#define LVAL_POOL_SIZE 4096
+
+typedef struct {
+    lval* items[LVAL_POOL_SIZE];
+    int count;
+} lval_pool;
+
+/* which operations run nested in which, counted when BUGSP_PROFILE is
+ * set to find the sequences worth a fused path. An op is an index into
+ * builtin_table or one of the LPROF_ values */
+
+#define LPROF_SLOTS 4096
+#define LPROF_DEPTH 256
+#define LPROF_TOP 12
+
+enum { LPROF_TOPLEVEL = -1, LPROF_LAMBDA = -2, LPROF_OTHER = -3 };
+
+typedef struct {
+    int ops[3];
+    long count;
+} lprof_entry;
+
+typedef struct {
+    int enabled;
+    int depth;
+    int stack[LPROF_DEPTH];
+    lprof_entry pairs[LPROF_SLOTS];
+    lprof_entry triples[LPROF_SLOTS];
+} lprof_table;
+
 /* constructors & destructors */
 
+lval* lval_alloc(void);
+void lval_free(lval* v);
 lval* lval_err(char* fmt, ...);
+lval* lval_err_code(int code, char* func, long x, long y, long z);
 lval* lval_num(long x);
 lval* lval_bool(int x);
 lval* lval_sym(char* s);
@@ -93,11 +503,46 @@ lval* lval_fun(lbuiltin func);
 lval* lval_lambda(lval* formals, lval* body);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
+lval* lval_seq(lseq* s);
+lval* lval_map(lmap* m);
+lval* lval_arr(larr* a);
+lval* lval_vec(lvec* v, long off, long len);
+lval* lval_memo(lmemo* m);
 void lval_del(lval* v);
 
 lenv* lenv_new(void);
 void lenv_del(lenv* e);
 
+lseq* lseq_new(int kind, lseq* src, lval* fn);
+void lseq_del(lseq* s);
+lseq* lseq_copy(lseq* s);
+lval* lseq_next(lenv* e, lseq* s);
+
+lmap* lmap_new(lmap_node* root, long count);
+lmap* lmap_fork(lmap* m);
+void lmap_del(lmap* m);
+void lmap_node_del(lmap_node* n);
+lmap_node* lmap_find(lmap* m, lval* k, unsigned long h);
+void lmap_put(lmap* m, lval* k, lval* v);
+int lmap_remove(lmap* m, lval* k);
+lmap_node** lmap_leaves(lmap_node* root, long count);
+
+larr* larr_new(long count);
+void larr_del(larr* a);
+
+lvec* lvec_new(long cap);
+void lvec_del(lvec* v);
+void lvec_push(lvec* v, lval* x);
+long lval_vec_len(lval* v);
+
+void lfun_del(lfun* f);
+
+lmemo* lmemo_new(lval* fn, long cap);
+void lmemo_del(lmemo* m);
+void lmemo_unlink(lmemo* m, lmemo_entry* x);
+void lmemo_evict(lmemo* m);
+lval* lmemo_call(lenv* e, lmemo* m, lval* a);
+
 /* lval helpers */
 
 lval* lval_read_num(mpc_ast_t* t);
@@ -105,61 +550,295 @@ lval* lval_read_str(mpc_ast_t* t);
 lval* lval_read(mpc_ast_t* t);
 void lval_expr_print(lval* v, char open, char close);
 void lval_print_str(lval* v);
+void lval_map_print(lval* v);
+void lval_arr_print(lval* v);
+void lval_vec_print(lval* v);
+char* lval_err_msg(lval* v);
 void lval_print(lval* v);
 void lval_println(lval* v);
 char* ltype_name(int t);
 
+void lval_forget(lval* v);
 lval* lval_add(lval* v, lval* x);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
 lval* lval_join(lval* x, lval* y);
 lval* lval_copy(lval* v);
+lval* lval_own(lval* v);
+lval* lval_own_cells(lval* a);
+lval* lval_intern(lval* v);
 lval* lval_eval_sexpr(lenv* e, lval* v);
+int lval_proven_holds(lval* v);
+lval* lval_eval_proven(lenv* e, lval* v);
+lval* lval_eval_call(lenv* e, lval* v);
+lval* lval_expand(lenv* e, lval* v, lscope* s);
+int lscope_has(lscope* s, lval* k);
+lval* lval_macro_find(lenv* e, lval* k);
+lval* lval_subst(lval* v, lval* formals, lval* args);
+lval* lval_macro_apply(lval* m, lval* args, int type);
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_loop_code(lenv* e, lval* v);
+lval* lval_eval_copy(lenv* e, lval* v);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_apply(lenv* e, lval* f, lval* a);
+lval* lval_trmc(lenv* frame, lfun* fn);
+int lbuiltin_shadowed(lval* k);
+lbuiltin lval_head_builtin(lenv* e, lval* v);
+int lval_is_branch(lenv* e, lval* v, int i);
+int lval_is_code(lbuiltin fn, lval* v, int i);
+int lval_is_builtin(lenv* e, lval* k, lbuiltin fn);
+void lval_trmc_mark(lenv* e, lval* k, lval* v);
+void lnum_del(lnum* n);
+lnum* lnum_leaf(lenv* e, lval* x);
+lnum* lnum_op(lenv* e, lval* v);
+void lnum_attach(lenv* e, lval* v);
+lval* lnum_eval(lenv* e, lnum* n, lval* v, long* r);
+lval* lnum_value(lenv* e, lval* v);
+int lnum_holds(lnum* n);
+lval* lnum_run(lenv* e, lval* v);
+lval* lval_item(lenv* e, lval* l, int i);
+lval* lval_force(lenv* e, lval* v);
 int lval_eq(lval* x, lval* y);
+int lval_err_cmp(lval* x, lval* y);
+int lval_cmp(lval* x, lval* y);
+int lval_hash_keeps(lval* v);
+unsigned long lval_hash(lval* v);
 
 /* lenv helpers */
 
+lval* lenv_find(lenv* e, lval* k);
 lval* lenv_get(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v);
 void lenv_def(lenv* e, lval* k, lval* v);
-lenv* lenv_copy(lenv* e);
+void lenv_bind(lenv* e, lval* k, lval* v);
+int lenv_index(lenv* e, lval* k);
+lval* lenv_swap(lenv* e, int i, lval* v);
+void lenv_set(lenv* e, int i, lval* v);
+void lenv_drop(lenv* e, int i);
 
 /* builtin functions */
 
 lval* builtin_list(lenv* e, lval* a);
 lval* builtin_head(lenv* e, lval* a);
+lval* builtin_head_fast(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_tail_fast(lenv* e, lval* a);
 lval* builtin_init(lenv* e, lval* a);
 lval* builtin_eval(lenv* e, lval* a);
+lval* builtin_eval_fast(lenv* e, lval* a);
+unsigned long lval_shape(lval* v, int* budget);
+int lval_marked(lval* v);
+int lval_graft(lval* to, lval* from);
+void leval_prepare(lenv* e, lval* x);
 lval* builtin_join(lenv* e, lval* a);
 lval* builtin_add(lenv* e, lval* a);
 lval* builtin_sub(lenv* e, lval* a);
 lval* builtin_mul(lenv* e, lval* a);
 lval* builtin_div(lenv* e, lval* a);
 lval* builtin_bool(lenv* e, lval* a);
+lval* builtin_the(lenv* e, lval* a);
 lval* builtin_lt(lenv* e, lval* a);
 lval* builtin_gt(lenv* e, lval* a);
 lval* builtin_le(lenv* e, lval* a);
 lval* builtin_ge(lenv* e, lval* a);
 lval* builtin_eq(lenv* e, lval* a);
+lval* builtin_eq_fast(lenv* e, lval* a);
 lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_ne_fast(lenv* e, lval* a);
 lval* builtin_and(lenv* e, lval* a);
+lval* builtin_and_fast(lenv* e, lval* a);
 lval* builtin_or(lenv* e, lval* a);
+lval* builtin_or_fast(lenv* e, lval* a);
 lval* builtin_not(lenv* e, lval* a);
+lval* builtin_not_fast(lenv* e, lval* a);
 lval* builtin_if(lenv* e, lval* a);
+lval* builtin_if_fast(lenv* e, lval* a);
+lval* builtin_select(lenv* e, lval* a);
+lval* builtin_case(lenv* e, lval* a);
+lval* builtin_match(lenv* e, lval* a);
+lval* lmatch_compile(lmatch* m, lval* p, int* path, int depth);
+void lmatch_del(lmatch* m);
+lmatch* lmatch_get(lval* a, unsigned long h, lval** err);
+long lmatch_len(lval* x);
+lval* lmatch_item(lval* x, long i);
+int lmatch_run(lmatch* m, int clause, lval* v, lenv* frame);
+int lcase_literal(lval** clauses, int n);
+lcase* lcase_new(lval** clauses, int n);
+void lcase_del(lcase* c);
+int lcase_find(lcase* c, lval** clauses, lval* x);
+lval* builtin_while(lenv* e, lval* a);
+lval* builtin_range_loop(lenv* e, lval* a, long start, long end);
+lval* builtin_dotimes(lenv* e, lval* a);
+lval* builtin_for(lenv* e, lval* a);
+lval* builtin_let(lenv* e, lval* a);
+lval* builtin_do(lenv* e, lval* a);
+lval* builtin_loop(lenv* e, lval* a);
+lval* builtin_recur(lenv* e, lval* a);
 lval* builtin_lambda(lenv* e, lval* a);
+lval* builtin_defmacro(lenv* e, lval* a);
 lval* bulitin_var(lenv* e, lval* a, char* func);
 lval* builtin_def(lenv* e, lval* a);
 lval* builtin_put(lenv* e, lval* a);
+lval* lval_read_file(char* path);
+void lenv_load(lenv* e, lval* expr);
 lval* builtin_load(lenv* e, lval* a);
+char* lmodule_path(lenv* e, char* name);
+void lenv_clear(lenv* e);
+lval* builtin_require(lenv* e, lval* a);
+lval* builtin_export(lenv* e, lval* a);
+lenv* lenv_namespace(lenv* e);
 lval* builtin_print(lenv* e, lval* a);
 lval* builtin_error(lenv* e, lval* a);
+lval* builtin_try(lenv* e, lval* a);
+
+/* memoisation */
+
+lval* builtin_memo(lenv* e, lval* a);
+lval* builtin_memo_stats(lenv* e, lval* a);
+
+/* list builtins */
+
+lval* builtin_len(lenv* e, lval* a);
+lval* builtin_empty(lenv* e, lval* a);
+lval* builtin_nth(lenv* e, lval* a);
+lval* builtin_last(lenv* e, lval* a);
+lval* builtin_map(lenv* e, lval* a);
+lval* builtin_filter(lenv* e, lval* a);
+lval* builtin_foldl(lenv* e, lval* a);
+lval* builtin_foldr(lenv* e, lval* a);
+lval* builtin_reverse(lenv* e, lval* a);
+lval* builtin_take(lenv* e, lval* a);
+lval* builtin_drop(lenv* e, lval* a);
+lval* builtin_elem(lenv* e, lval* a);
+lval* builtin_zip(lenv* e, lval* a);
+lval* builtin_unzip(lenv* e, lval* a);
+lval* builtin_reduce_num(lenv* e, lval* a, char* func, long z, int mul);
+lval* builtin_sum(lenv* e, lval* a);
+lval* builtin_product(lenv* e, lval* a);
+lval* builtin_takewhile(lenv* e, lval* a);
+
+/* sorting */
+
+void lsort_radix(lsort_item* items, lsort_item* tmp, long n);
+void lsort_merge(lsort_item* items, lsort_item* tmp, long lo, long mid, long hi, int ints);
+void lsort_mergesort(lsort_item* items, lsort_item* tmp, long lo, long hi);
+void* lsort_chunk_worker(void* arg);
+void* lsort_merge_worker(void* arg);
+void lsort_items(lsort_item* items, long n, int ints);
+lval* builtin_sort_list(lenv* e, lval* a, lval* f);
+lval* builtin_sort(lenv* e, lval* a);
+lval* builtin_sort_by(lenv* e, lval* a);
+
+/* hash map builtins */
+
+lval* builtin_hash_map(lenv* e, lval* a);
+lval* builtin_hash_get(lenv* e, lval* a);
+lval* builtin_hash_has(lenv* e, lval* a);
+lval* builtin_hash_set(lenv* e, lval* a, char* func, int cow);
+lval* builtin_hash_put(lenv* e, lval* a);
+lval* builtin_hash_put_mut(lenv* e, lval* a);
+lval* builtin_hash_unset(lenv* e, lval* a, char* func, int cow);
+lval* builtin_hash_del(lenv* e, lval* a);
+lval* builtin_hash_del_mut(lenv* e, lval* a);
+lval* builtin_hash_list(lenv* e, lval* a, char* func, int what);
+lval* builtin_hash_keys(lenv* e, lval* a);
+lval* builtin_hash_vals(lenv* e, lval* a);
+lval* builtin_hash_items(lenv* e, lval* a);
+lval* builtin_hash_each(lenv* e, lval* a);
+
+/* array kernels & builtins */
+
+long larr_sum_scalar(const long* x, long n);
+long larr_min_scalar(const long* x, long n);
+long larr_max_scalar(const long* x, long n);
+void larr_add_scalar(long* r, const long* x, const long* y, long n);
+void larr_sub_scalar(long* r, const long* x, const long* y, long n);
+long larr_product(const long* x, long n);
+long larr_dot(const long* x, const long* y, long n);
+void larr_init_kernels(void);
+
+lval* builtin_array(lenv* e, lval* a);
+lval* builtin_array_list(lenv* e, lval* a);
+lval* builtin_array_range(lenv* e, lval* a);
+lval* builtin_array_get(lenv* e, lval* a);
+lval* builtin_array_fold(lenv* e, lval* a, char* func, int op);
+lval* builtin_array_sum(lenv* e, lval* a);
+lval* builtin_array_product(lenv* e, lval* a);
+lval* builtin_array_min(lenv* e, lval* a);
+lval* builtin_array_max(lenv* e, lval* a);
+lval* builtin_array_dot(lenv* e, lval* a);
+lval* builtin_array_op(lenv* e, lval* a, char* func, char op);
+lval* builtin_array_add(lenv* e, lval* a);
+lval* builtin_array_sub(lenv* e, lval* a);
+lval* builtin_array_mul(lenv* e, lval* a);
+lval* builtin_array_div(lenv* e, lval* a);
+
+/* vector builtins */
+
+lval* builtin_vec(lenv* e, lval* a);
+lval* builtin_vec_from(lenv* e, lval* a);
+lval* builtin_vec_make(lenv* e, lval* a);
+lval* builtin_vec_list(lenv* e, lval* a);
+lval* builtin_vec_get(lenv* e, lval* a);
+lval* builtin_vec_set(lenv* e, lval* a);
+lval* builtin_vec_push(lenv* e, lval* a);
+lval* builtin_vec_slice(lenv* e, lval* a);
+
+/* sequence builtins */
+
+lval* builtin_range(lenv* e, lval* a);
+lval* builtin_lazy(lenv* e, lval* a);
+lval* builtin_collect(lenv* e, lval* a);
+lval* builtin_seq_stage(lenv* e, lval* a, char* func, int kind);
 
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
+lbuiltin_desc* lbuiltin_find(lbuiltin fn);
+unsigned long lbuiltin_name_hash(char* name);
+lbuiltin_desc* lbuiltin_named(char* name);
+int lbuiltin_shadows(lbuiltin_desc* d, lval* v);
+void lbuiltin_shadow(char* sym, lval* old, lval* v);
+int lbuiltin_type(lenv* e, lval* x);
+lbuiltin_desc* lbuiltin_site(lenv* e, lval* v);
+lval* lfuse_if(lenv* e, lval* v);
+lval* lfuse_eval_head(lenv* e, lval* v);
+lval* lcase_value(lenv* e, lval* v);
+lval* lfuse_case(lenv* e, lval* v);
+lbuiltin_desc* lbuiltin_fuse(lenv* e, lval* v, lbuiltin_desc* d);
+void lbuiltin_mark(lenv* e, lval* v, int fold);
+void lcase_attach(lval* v);
 void lenv_add_builtins(lenv* e);
 
+/* profiling */
+
+int lprof_op(lenv* e, lval* v);
+char* lprof_name(int op);
+void lprof_count(lprof_entry* t, int* ops, int n);
+lval* lprof_eval_sexpr(lenv* e, lval* v);
+int lprof_cmp(const void* x, const void* y);
+void lprof_print(char* title, lprof_entry* t, int n);
+void lprof_report(void);
+
+/* interpreter state, one per process. None of it is locked: the
+ * evaluator runs on the main thread only, and the sort threads only
+ * compare the lvals they're handed. In particular the lval pool in
+ * free_lvals is shared by the whole process, so nothing on those threads
+ * may allocate or free an lval, nor write into one as lval_err_msg does */
+
+larr_kernels arr_kernels;
+lintern_table intern_table;
+long macro_count;
+lmodule_table module_table;
+lmatch_table match_table;
+leval_cache eval_cache;
+lval_pool free_lvals;
+lprof_table profile;
+/* the live bindings of builtins' names to something else, summed over
+ * every builtin's shadows. While it's 0 what lbuiltin_mark proved holds
+ * everywhere */
+int builtins_shadowed;
+/* the loops being run, recur is an error outside of all of them */
+int loop_depth;
+
 /* mpc parsers */
 
 mpc_parser_t* Number;